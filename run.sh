@@ -10,23 +10,28 @@ QEMU=qemu-system-riscv32
 #CC=/opt/homebrew/opt/llvm/bin/clang
 CC=clang
 CFLAGS="-std=c11 -O2 -g3 -Wall -Wextra --target=riscv32 -ffreestanding -nostdlib"
+# RVV=1 ./run.sh: 커널의 memcpy/memset/strcpy/strcmp를 벡터 명령(RVV)으로 빌드하고 QEMU에서 벡터 확장을 켠다. (shell의 membench로 측정)
+# 벡터 레지스터는 문맥 교환 때 저장하지 않으므로 U-Mode에서는 벡터 확장을 꺼 두고(sstatus.VS), 사용자 프로그램은 벡터 확장 없이 빌드한다.
+# 정수 벡터만 사용하므로 F/D 확장이 필요 없는 Zve32x를 사용한다.
+KERNEL_CFLAGS="$CFLAGS"
+QEMU_CPU=rv32
+if [ "${RVV:-0}" = 1 ]; then
+    KERNEL_CFLAGS="$CFLAGS -march=rv32imac_zve32x -mabi=ilp32"
+    QEMU_CPU="rv32,v=true,vlen=128"
+fi
 
 # c 파일을 컴파일하고 user.ld 링커 스크립트와 연결
 $CC $CFLAGS -Wl,-Tuser.ld -Wl,-Map=shell.map -o shell.elf \
     src/app/shell.c src/user/user.c src/common/common.c
-# 실행파일 elf를 원시 바이너리로 변환 
-# 원시 바이너리는 기본 주소(0x1000000)에서 메모리로 확장되는 실제 콘텐츠. 
-# OS는 원시 바이너리의 내용을 복사하는 것만으로 애플리케이션을 메모리에 준비할 수 있음
-# 일반적인 OS는 메모리 내용과 매핑 정보가 분리된 ELF와 같은 형식을 사용 -> 단순화를 위해 원시 바이너리 사용
-# ELF와 같은 실행파일 형식의 경우 로드 주소는 파일 헤더에 저장됨. 하지만 어플리케이션의 실행 이미지는 원시 바이너리이므로 이와 같이 고정된 값으로 준비해야됨
-$OBJCOPY --set-section-flags .bss=alloc,contents -O binary shell.elf shell.bin
-
-# 원시 바이너리 실행 이미지를 C 언어에 임베드할 수 잇는 형식으로 변환 llvm-nm 명령을 사용하려 내부 확인 가능
-$OBJCOPY -Ibinary -Oelf32-littleriscv shell.bin shell.bin.o
+# 실행파일 elf를 그대로 커널에 임베드한다.
+# 커널의 ELF 로더(image_load)가 PT_LOAD 세그먼트를 읽어 세그먼트마다 실제 권한(R/W/X)으로 매핑하고,
+# .bss(스택 포함)처럼 p_memsz가 p_filesz보다 큰 부분은 복사하지 않고 처음 접근할 때 0으로 채운 페이지를 매핑한다.
+# llvm-nm 명령을 사용하여 내부 확인 가능 (_binary_shell_elf_start, _binary_shell_elf_size)
+$OBJCOPY -Ibinary -Oelf32-littleriscv shell.elf shell.elf.o
 
 # new: Build the Kernel
-$CC $CFLAGS -Wl,-Tkernel.ld -Wl,-Map=kernel.map -o kernel.elf \
-    src/core/kernel.c src/common/common.c shell.bin.o
+$CC $KERNEL_CFLAGS -Wl,-Tkernel.ld -Wl,-Map=kernel.map -o kernel.elf \
+    src/core/kernel.c src/common/common.c shell.elf.o
 
 # -machine virt: virt 머신을 시작
 # -bios default: 기본 펌웨어(이 경우 OpenSBI)를 사용
@@ -37,10 +42,18 @@ $CC $CFLAGS -Wl,-Tkernel.ld -Wl,-Map=kernel.map -o kernel.elf \
 # -drive id=drive0: 드라이브0이라는 이름의 디스크를 정의하고, 디스크 이미지로 lorem.txt를 사용한다.
 # 디스크 이미지 형식은 raw(파일 내용을 그대로 디스크 데이터로 취급)
 
-(cd disk && tar cf ../disk.tar --format=ustar ./*.txt)
+# shell 이외의 사용자 프로그램은 디스크에 넣어 shell에서 spawn으로 실행한다.
+mkdir -p disk
+APPS="echo"
+for app in $APPS; do
+    $CC $CFLAGS -Wl,-Tuser.ld -o disk/$app \
+        src/app/$app.c src/user/user.c src/common/common.c
+done
+
+(cd disk && tar cf ../disk.tar --format=ustar ./*.txt $(for app in $APPS; do echo ./$app; done))
 
 # -device virtio-blk-device: 디스크 drive0에 virtio-blk 장치를 추가한다. bus=virtio-mmio-bus.0은 장치를 virtio-mmio버스 (메모리 매핑된 I/O를 통한 가상화)에 매핑한다.
-$QEMU -machine virt -bios default -nographic -serial mon:stdio --no-reboot \
+$QEMU -machine virt -cpu $QEMU_CPU -bios default -nographic -serial mon:stdio --no-reboot \
     -d unimp,guest_errors,int,cpu_reset -D qemu.log \
     -drive id=drive0,file=disk.tar,format=raw,if=none \
     -device virtio-blk-device,drive=drive0,bus=virtio-mmio-bus.0 \
@@ -0,0 +1,9 @@
+#include "../include/user/user.h"
+
+// 전달받은 인자를 공백으로 구분해서 출력한다. (shell에서 spawn으로 실행)
+void main(int argc, char **argv){
+    for (int i = 1; i < argc; i++){
+        printf(i + 1 < argc ? "%s " : "%s", argv[i]);
+    }
+    printf("\n");
+}
@@ -8,24 +8,12 @@ void main(void){
     */
     //*((volatile int *) 0x80200000) = 0x1234;
     while(1){
-prompt:
         printf("> ");
         char cmdline[128];
-        for(int i=0;;i++){
-            char ch = getchar();
-            putchar(ch);
-
-            if(i == sizeof(cmdline) - 1){
-                printf("command line to long\n");
-                goto prompt;
-                // debug console에서 newline은 \r이다.
-            } else if (ch == '\r'){
-                printf("\n");
-                cmdline[i] = '\0';
-                break;
-            } else {
-                cmdline[i] = ch;
-            }
+        // 에코와 백스페이스 처리는 커널의 라인 규칙이 하므로 한 줄을 시스템 콜 한 번으로 읽는다.
+        if(readline(cmdline, sizeof(cmdline)) < 0){
+            printf("command line to long\n");
+            continue;
         }
 
         if(strcmp(cmdline, "hello") == 0){
@@ -36,15 +24,100 @@ prompt:
         } 
         else if (strcmp(cmdline, "readfile") == 0) {
             char buf[128]; 
-            int len = readfile("./hello.txt", buf, sizeof(buf));
+            int len = readfile("./hello.txt", buf, sizeof(buf) - 1);
             buf[len] = '\0';
             printf("%s\n", buf);
         } 
         else if (strcmp(cmdline, "writefile") == 0) {
             writefile("./hello.txt", "Hello from shell!\n", 19);
         }
+        else if (strcmp(cmdline, "cat") == 0) {
+            // 작은 버퍼로 나누어 끝까지 순차적으로 읽는다.
+            int fd = open("./hello.txt", O_RDONLY);
+            if(fd < 0){
+                printf("cannot open ./hello.txt\n");
+                continue;
+            }
+
+            char buf[16];
+            int len;
+            while((len = read(fd, buf, sizeof(buf))) > 0){
+                for (int i = 0; i < len; i++){
+                    putchar(buf[i]);
+                }
+            }
+            close(fd);
+        }
+        else if (strcmp(cmdline, "mapcat") == 0) {
+            // 파일 페이지를 매핑해서 복사 없이 읽는다. 파일 끝 이후의 페이지 내용은 0이다.
+            int fd = open("./hello.txt", O_RDONLY);
+            int size = fd < 0 ? -1 : lseek(fd, 0, SEEK_END);
+            const char *p = size <= 0 ? (void *) -1 : mmap(fd, 0, size, PROT_READ);
+            if(p == (void *) -1){
+                printf("cannot map ./hello.txt\n");
+                if(fd >= 0){
+                    close(fd);
+                }
+                continue;
+            }
+
+            // 파일 크기가 페이지 크기의 배수이면 매핑 끝에 NULL이 없으므로 크기만큼만 출력한다.
+            write(FD_STDOUT, p, size);
+            munmap((void *) p, size);
+            close(fd);
+        }
+        else if (strcmp(cmdline, "fork") == 0) {
+            int pid = fork();
+            if(pid == 0){
+                printf("hello from child\n");
+                exit();
+            }
+            printf("forked process %d\n", pid);
+        }
+        else if (strcmp(cmdline, "memstat") == 0) {
+            kstat(KSTAT_PAGES);
+        }
+        else if (strcmp(cmdline, "ps") == 0) {
+            kstat(KSTAT_PROCS);
+        }
+        else if (strcmp(cmdline, "membench") == 0) {
+            kstat(KSTAT_MEMBENCH);
+        }
+        else if (strcmp(cmdline, "bcstat") == 0) {
+            kstat(KSTAT_BCACHE);
+        }
         else {
-            printf("unknown command: %s\n", cmdline);
+            // 내장 명령이 아니면 디스크에 있는 프로그램(./<이름>)을 실행하고 끝날 때까지 기다린다.
+            char *argv[17];
+            int argc = 0;
+            for (char *p = cmdline; *p && argc < 16;){
+                while (*p == ' '){
+                    *p++ = '\0';
+                }
+
+                if (*p){
+                    argv[argc++] = p;
+                }
+
+                while (*p && *p != ' '){
+                    p++;
+                }
+            }
+            argv[argc] = NULL;
+
+            if (argc == 0){
+                continue;
+            }
+
+            // argv[0]은 cmdline의 일부이므로 "./"를 붙여도 이 크기를 넘지 않는다.
+            char path[sizeof(cmdline) + 2] = "./";
+            strcpy(argv[0][0] == '.' && argv[0][1] == '/' ? path : path + 2, argv[0]);
+            int pid = spawn(path, argv);
+            if (pid < 0){
+                printf("unknown command: %s\n", argv[0]);
+            } else {
+                wait(pid);
+            }
         }
     }
 }
\ No newline at end of file
@@ -71,9 +71,145 @@ end:
     va_end(vargs);
 }
 
+/*
+    memcpy, memset, strcpy, strcmp
+    페이지 0 채우기(alloc_pages), 이미지 복사, 디스크/파일 버퍼 복사 등 거의 모든 경로에서 사용하므로 바이트 단위가 아니라 넓게 처리한다.
+    - 기본: 4바이트(word) 단위. 주소가 정렬될 때까지 앞부분(head)은 바이트 단위로, 정렬된 가운데는 word 단위(4개씩 펼쳐서)로,
+      남은 뒷부분(tail)은 다시 바이트 단위로 처리한다. RV32에서 정렬되지 않은 word 접근은 트랩으로 에뮬레이션될 수 있으므로
+      두 주소의 word 내 오프셋이 서로 다르면 바이트 단위로 처리한다.
+    - 벡터 확장으로 빌드하면(__riscv_vector) RVV 명령으로 처리한다. (vsetvli로 한 번에 처리할 바이트 수를 정하는 strip-mining)
+      문자열 함수는 fault-only-first 로드(vle8ff)를 사용하므로 문자열 끝 이후의 매핑되지 않은 페이지를 건드려도 예외가 발생하지 않는다.
+      벡터 레지스터는 문맥 교환 때 저장하지 않으므로 벡터 확장으로는 커널만 빌드한다. (커널 코드는 선점되지 않는다)
+*/
+typedef uint32_t __attribute__((may_alias)) word_t;
+
+#define WORD_SIZE  sizeof(word_t)
+#define WORD_ONES  0x01010101u
+#define WORD_HIGHS 0x80808080u
+// w의 바이트 중 0이 있으면 0이 아닌 값이 된다.
+#define word_has_zero(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS)
+
+#ifdef __riscv_vector
+
+void *memcpy(void *dst, const void *src, size_t n){
+    uint8_t *d = (uint8_t *) dst;
+    const uint8_t *s = (const uint8_t *) src;
+    while(n > 0){
+        size_t vl;
+        __asm__ __volatile__(
+            "vsetvli %0, %3, e8, m8, ta, ma\n"
+            "vle8.v v8, (%2)\n"
+            "vse8.v v8, (%1)\n"
+            : "=&r"(vl)
+            : "r"(d), "r"(s), "r"(n)
+            : "memory", "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15");
+        d += vl;
+        s += vl;
+        n -= vl;
+    }
+    return dst;
+}
+
+void *memset(void *buf, char c, size_t n){
+    uint8_t *p = (uint8_t *) buf;
+    while(n > 0){
+        size_t vl;
+        __asm__ __volatile__(
+            "vsetvli %0, %2, e8, m8, ta, ma\n"
+            "vmv.v.x v8, %3\n"
+            "vse8.v v8, (%1)\n"
+            : "=&r"(vl)
+            : "r"(p), "r"(n), "r"((uint32_t) (uint8_t) c)
+            : "memory", "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15");
+        p += vl;
+        n -= vl;
+    }
+    return buf;
+}
+
+// 한 번에 최대한 읽고, 0인 바이트까지(포함) 마스크를 만들어 그 부분만 쓴다.
+char *strcpy(char *dst, const char *src){
+    char *d = dst;
+    for(;;){
+        size_t vl;
+        long zero;
+        __asm__ __volatile__(
+            "vsetvli zero, %4, e8, m8, ta, ma\n"
+            "vle8ff.v v8, (%2)\n"
+            "csrr %0, vl\n"
+            "vmseq.vi v1, v8, 0\n"
+            "vfirst.m %1, v1\n"
+            "vmsif.m v0, v1\n"
+            "vse8.v v8, (%3), v0.t\n"
+            : "=&r"(vl), "=&r"(zero)
+            : "r"(src), "r"(d), "r"(-1)
+            : "memory", "v0", "v1", "v8", "v9", "v10", "v11", "v12", "v13", "v14", "v15");
+        if(zero >= 0){
+            break;
+        }
+        src += vl;
+        d += vl;
+    }
+    return dst;
+}
+
+// 두 문자열에서 처음으로 다르거나 0인 바이트의 위치를 찾는다.
+int strcmp(const char *s1, const char *s2){
+    for(;;){
+        size_t vl;
+        long diff;
+        __asm__ __volatile__(
+            "vsetvli zero, %4, e8, m4, ta, ma\n"
+            "vle8ff.v v8, (%2)\n"
+            "vle8ff.v v16, (%3)\n"
+            "csrr %0, vl\n"
+            "vmseq.vi v0, v8, 0\n"
+            "vmsne.vv v1, v8, v16\n"
+            "vmor.mm v0, v0, v1\n"
+            "vfirst.m %1, v0\n"
+            : "=&r"(vl), "=&r"(diff)
+            : "r"(s1), "r"(s2), "r"(-1)
+            : "memory", "v0", "v1", "v8", "v9", "v10", "v11", "v16", "v17", "v18", "v19");
+        if(diff >= 0){
+            s1 += diff;
+            s2 += diff;
+            break;
+        }
+        s1 += vl;
+        s2 += vl;
+    }
+
+    return *(unsigned char *)s1 - *(unsigned char *)s2;
+}
+
+#else
+
 void *memcpy(void *dst, const void *src, size_t n){
     uint8_t *d = (uint8_t *)dst;
     const uint8_t *s = (const uint8_t *)src;
+    if(n >= 4 * WORD_SIZE && is_aligned((uint32_t) d ^ (uint32_t) s, WORD_SIZE)){
+        while(!is_aligned((uint32_t) d, WORD_SIZE)){
+            *d++ = *s++;
+            n--;
+        }
+
+        word_t *dw = (word_t *) d;
+        const word_t *sw = (const word_t *) s;
+        for(; n >= 4 * WORD_SIZE; n -= 4 * WORD_SIZE){
+            dw[0] = sw[0];
+            dw[1] = sw[1];
+            dw[2] = sw[2];
+            dw[3] = sw[3];
+            dw += 4;
+            sw += 4;
+        }
+        for(; n >= WORD_SIZE; n -= WORD_SIZE){
+            *dw++ = *sw++;
+        }
+        d = (uint8_t *) dw;
+        s = (const uint8_t *) sw;
+    }
+
     while(n--){
         *d++ = *s++;
     }
@@ -88,6 +224,27 @@ void *memcpy(void *dst, const void *src, size_t n){
 
 void *memset(void *buf, char c, size_t n){
     uint8_t *p = (uint8_t *) buf;
+    if(n >= 4 * WORD_SIZE){
+        word_t w = (uint8_t) c * WORD_ONES;
+        while(!is_aligned((uint32_t) p, WORD_SIZE)){
+            *p++ = c;
+            n--;
+        }
+
+        word_t *pw = (word_t *) p;
+        for(; n >= 4 * WORD_SIZE; n -= 4 * WORD_SIZE){
+            pw[0] = w;
+            pw[1] = w;
+            pw[2] = w;
+            pw[3] = w;
+            pw += 4;
+        }
+        for(; n >= WORD_SIZE; n -= WORD_SIZE){
+            *pw++ = w;
+        }
+        p = (uint8_t *) pw;
+    }
+
     while(n--){
         *p++ = c;
     }
@@ -95,24 +252,63 @@ void *memset(void *buf, char c, size_t n){
     return buf;
 }
 
+// 정렬된 word는 페이지 경계를 넘지 않으므로 문자열 끝이 들어 있는 word 전체를 읽어도 안전하다.
 char *strcpy(char *dst, const char *src){
     char *d = dst;
-    while (*src){
-        *d++ = *src++;
+    if(is_aligned((uint32_t) d ^ (uint32_t) src, WORD_SIZE)){
+        while(!is_aligned((uint32_t) src, WORD_SIZE)){
+            if((*d++ = *src++) == '\0'){
+                return dst;
+            }
+        }
+
+        word_t *dw = (word_t *) d;
+        const word_t *sw = (const word_t *) src;
+        while(!word_has_zero(*sw)){
+            *dw++ = *sw++;
+        }
+        d = (char *) dw;
+        src = (const char *) sw;
     }
-    *d = '\0';
+
+    while ((*d++ = *src++) != '\0'){}
     return dst;
 }
 
 int strcmp(const char *s1, const char *s2){
-    while (*s1 && *s2){
-        if (*s1 != *s2){
-            break;
+    if(is_aligned((uint32_t) s1 ^ (uint32_t) s2, WORD_SIZE)){
+        while(!is_aligned((uint32_t) s1, WORD_SIZE) && *s1 && *s1 == *s2){
+            s1++;
+            s2++;
         }
 
+        if(is_aligned((uint32_t) s1, WORD_SIZE)){
+            const word_t *w1 = (const word_t *) s1;
+            const word_t *w2 = (const word_t *) s2;
+            while(*w1 == *w2 && !word_has_zero(*w1)){
+                w1++;
+                w2++;
+            }
+            s1 = (const char *) w1;
+            s2 = (const char *) w2;
+        }
+    }
+
+    // 다른 바이트 또는 문자열의 끝을 바이트 단위로 찾는다.
+    while (*s1 && *s1 == *s2){
         s1++;
         s2++;
     }
 
     return *(unsigned char *)s1 - *(unsigned char *)s2;
-}
\ No newline at end of file
+}
+
+#endif
+
+size_t strlen(const char *s){
+    size_t len = 0;
+    while (s[len]){
+        len++;
+    }
+    return len;
+}
@@ -13,13 +13,21 @@ extern char __free_ram[], __free_ram_end[];
 */
 extern char __kernel_base[]; 
 
-extern char _binary_shell_bin_start[], _binary_shell_bin_size[];
+extern char _binary_shell_elf_start[], _binary_shell_elf_size[];
 
 struct process *current_proc; // Current running process
 struct process *idle_proc; // Idle process (실행 가능한 프로세스가 없을 때 실행할 유휴 프로세스)
+uint32_t *kernel_page_table; // 모든 프로세스가 공유하는 커널 영역 매핑 (kernel_vm_init)
 
-struct file files[FILES_MAX];
-uint8_t disk[DISK_MAX_SIZE];
+unsigned blk_capacity; // 디스크 용량 (바이트, virtio_blk_init)
+
+struct file *file_head, *file_tail; // tar 아카이브에 있는 순서대로 연결된 파일 목록
+struct file *file_free_list; // 사용하지 않는 파일 객체 목록 (file_alloc)
+struct open_file open_files[OPEN_FILES_MAX];
+unsigned fs_gen; // 마지막으로 나눠 준 file->gen (모든 파일에서 증가하므로 재사용된 파일 객체와도 겹치지 않는다)
+unsigned fs_end_sector; // 디스크에 기록된 tar 아카이브의 끝 표시가 시작되는 섹터 (fs_flush)
+unsigned fs_used_sectors; // 메모리의 파일 목록을 아카이브로 기록할 때 필요한 섹터 수 (끝 표시 제외)
+bool fs_locked; // 파일 시스템을 사용 중인 프로세스가 있는지 (fs_lock)
 
 int oct2int(char *oct, int len) {
     int dec = 0;
@@ -35,22 +43,24 @@ int oct2int(char *oct, int len) {
 }
 
 /*
-    이 함수에서는 먼저 read_write_disk함수를 사용하여 디스크 이미지를 임시 버퍼(디스크 변수)에 로드한다.
-    디스크 변수는 로컬(스택)변수가 아닌 정적 변수로 선언
-    스택의 크기는 제한되어 있으므로 큰 데이터 영역에는 사용하지 않는 것이 좋음
-    디스크 내용을 로드한 후 파일 변수 항목에 순차적으로 복사. 
+    디스크 전체를 읽지 않고 tar 헤더만 훑어서 파일 목록(이름, 헤더 섹터, 크기)을 만든다.
+    헤더의 size로 데이터 섹터를 건너뛰어 다음 헤더로 바로 이동하므로 부팅 시간은 파일 데이터 크기와 관계없이 파일 개수에만 비례한다.
+    파일 내용은 처음 접근할 때 fs_load가 읽어온다.
     tar 헤더의 숫자는 8진수 형식이라는 점 유의. 소수점 처럼 보일 수 있음
-    마지막으로 kernel_main에서 virtio-blk 디바이스를 초기화한 후 fs_init 함수를 호출(virto_blk_init)
+    kernel_main에서 virtio-blk 디바이스와 버퍼 캐시를 초기화한 후 fs_init 함수를 호출
 */
 void fs_init(void){
-    for (unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++){
-        read_write_disk(&disk[sector * SECTOR_SIZE], sector, false);
-    }
+    unsigned sector = 0, nsectors = DISK_MAX_SIZE / SECTOR_SIZE, count = 0;
+    while(sector < nsectors){
+        struct buf *b = bread(sector);
+        if(!b){
+            printf("fs: failed to read the header at sector %d\n", sector);
+            break;
+        }
 
-    unsigned off = 0;
-    for (int i=0; i<FILES_MAX;i++){
-        struct tar_header *header = (struct tar_header *)&disk[off];
+        struct tar_header *header = (struct tar_header *) b->data;
         if(header->name[0] == '\0'){
+            brelse(b);
             break;
         }
 
@@ -59,64 +69,530 @@ void fs_init(void){
         }
 
         int filesz = oct2int(header->size, sizeof(header->size));
-        struct file *file = &files[i];
-        file->in_use = true;
+        struct file *file = file_alloc();
         strcpy(file->name, header->name);
-        memcpy(file->data, header->data, filesz);
         file->size = filesz;
-        printf("file: %s, size=%d\n", file->name, file->size);
+        file->disk_size = filesz;
+        file->sector = sector;
+        brelse(b);
 
-        off += align_up(sizeof(struct tar_header) + filesz, SECTOR_SIZE);
+        sector += 1 + align_up(filesz, SECTOR_SIZE) / SECTOR_SIZE;
+        count++;
     }
+
+    fs_end_sector = fs_used_sectors = sector;
+    fs_index_rebuild(count);
+    printf("fs: %d files, %d sectors used\n", count, fs_end_sector);
 }
 
-void fs_flush(void){
-    // Copy all file contents into disk buffer
-    memset(disk, 0, sizeof(disk));
-    unsigned off = 0;
-    for (int file_i = 0; file_i < FILES_MAX; file_i++){
-        struct file *file = &files[file_i];
-        if(!file->in_use){
-            continue;
+/*
+    파일 객체는 페이지 단위로 할당받아 잘라 쓴다. 반환된 객체는 file_free_list에 모아 재사용한다.
+    새 파일은 아카이브의 마지막(file_tail)에 붙는다.
+*/
+struct file *file_alloc(void){
+    if(!file_free_list){
+        struct file *objs = (struct file *) alloc_pages(1);
+        for (unsigned i = 0; i < PAGE_SIZE / sizeof(struct file); i++){
+            objs[i].next = file_free_list;
+            file_free_list = &objs[i];
+        }
+    }
+
+    struct file *file = file_free_list;
+    file_free_list = file->next;
+    memset(file, 0, sizeof(*file));
+    file->in_use = true;
+    file->gen = ++fs_gen;
+
+    if(file_tail){
+        file_tail->next = file;
+    } else {
+        file_head = file;
+    }
+    file_tail = file;
+    return file;
+}
+
+/*
+    파일의 데이터 페이지를 npages개로 맞춘다.
+    pages 배열도 페이지 단위로 할당하며 모자라면 두 배로 늘린다.
+*/
+void fs_reserve_pages(struct file *file, unsigned npages){
+    if(npages > file->pages_cap){
+        unsigned cap = file->pages_cap ? file->pages_cap * 2 : PAGE_SIZE / sizeof(paddr_t);
+        while(cap < npages){
+            cap *= 2;
+        }
+
+        paddr_t *pages = (paddr_t *) alloc_pages(cap * sizeof(paddr_t) / PAGE_SIZE);
+        if(file->pages){
+            memcpy(pages, file->pages, file->npages * sizeof(paddr_t));
+            free_pages((paddr_t) file->pages, file->pages_cap * sizeof(paddr_t) / PAGE_SIZE);
+        }
+        file->pages = pages;
+        file->pages_cap = cap;
+    }
+
+    while(file->npages < npages){
+        file->pages[file->npages++] = alloc_pages(1);
+    }
+
+    // mmap으로 매핑된 페이지는 매핑이 사라질 때 반환된다.
+    while(file->npages > npages){
+        page_put(file->pages[--file->npages]);
+    }
+}
+
+// 파일 크기를 size로 바꾸고 데이터 페이지와 아카이브 크기(fs_used_sectors)를 그에 맞춘다.
+void fs_resize(struct file *file, size_t size){
+    fs_reserve_pages(file, align_up(size, PAGE_SIZE) / PAGE_SIZE);
+
+    // 마지막 페이지에서 새 크기를 넘는 부분은 0으로 유지한다.
+    if(size < file->size && size % PAGE_SIZE){
+        memset((void *) (file->pages[size / PAGE_SIZE] + size % PAGE_SIZE), 0, PAGE_SIZE - size % PAGE_SIZE);
+    }
+
+    file->gen = ++fs_gen;
+    fs_used_sectors += align_up(size, SECTOR_SIZE) / SECTOR_SIZE;
+    fs_used_sectors -= align_up(file->size, SECTOR_SIZE) / SECTOR_SIZE;
+    file->size = size;
+    if(file->size != file->disk_size){
+        file->header_dirty = true;
+    }
+}
+
+/*
+    파일 시스템 잠금
+    디스크 I/O(bread, bget, bsync)는 완료될 때까지 잠들기 때문에, 그 사이 다른 프로세스가 파일 목록이나 파일 내용을 바꾸면
+    fs_load가 반환된 페이지에 쓰거나 fs_flush/fs_delete가 빠져나간 파일 객체를 따라가게 된다.
+    파일 시스템을 사용하는 시스템 콜은 처음부터 끝까지 이 잠금을 잡아서 한 번에 하나씩 실행되게 한다.
+    부팅 중(fs_init)에는 다른 프로세스가 없으므로 잠금을 잡지 않는다.
+*/
+void fs_lock(void){
+    while(fs_locked){
+        proc_sleep(&fs_locked);
+    }
+    fs_locked = true;
+}
+
+void fs_unlock(void){
+    fs_locked = false;
+    proc_wakeup(&fs_locked);
+}
+
+// 파일의 off 위치부터 len 바이트를 buf로 복사한다. 내용을 아직 읽지 않았다면 먼저 읽는다.
+int fs_read(struct file *file, size_t off, void *buf, size_t len){
+    if(off >= file->size){
+        return 0;
+    }
+
+    if(len > file->size - off){
+        len = file->size - off;
+    }
+
+    if(fs_load(file) < 0){
+        return -1;
+    }
+
+    for (size_t done = 0; done < len;){
+        size_t pos = off + done;
+        size_t n = PAGE_SIZE - pos % PAGE_SIZE < len - done ? PAGE_SIZE - pos % PAGE_SIZE : len - done;
+        memcpy((uint8_t *) buf + done, (void *) (file->pages[pos / PAGE_SIZE] + pos % PAGE_SIZE), n);
+        done += n;
+    }
+
+    return len;
+}
+
+// buf의 len 바이트를 파일의 off 위치에 쓴다. 필요하면 파일을 늘리고, 바뀐 영역을 dirty로 표시한다.
+int fs_write(struct file *file, size_t off, const void *buf, size_t len){
+    if(fs_load(file) < 0){
+        return -1;
+    }
+
+    // 파일 끝을 넘어(lseek) 쓰면 옛 끝과 off 사이는 fs_resize가 0으로 채우므로 그 부분도 디스크에 기록해야 한다.
+    size_t dirty_start = off < file->size ? off : file->size;
+    if(off + len > file->size){
+        fs_resize(file, off + len);
+    }
+
+    for (size_t done = 0; done < len;){
+        size_t pos = off + done;
+        size_t n = PAGE_SIZE - pos % PAGE_SIZE < len - done ? PAGE_SIZE - pos % PAGE_SIZE : len - done;
+        memcpy((void *) (file->pages[pos / PAGE_SIZE] + pos % PAGE_SIZE), (const uint8_t *) buf + done, n);
+        done += n;
+    }
+
+    fs_mark_dirty(file, dirty_start, off + len - dirty_start);
+    return len;
+}
+
+// 파일 크기가 size로 바뀌었을 때 아카이브가 디스크에 들어가는지 확인한다. (끝 표시 2섹터 포함)
+bool fs_fits(struct file *file, size_t size){
+    unsigned old = align_up(file->size, SECTOR_SIZE) / SECTOR_SIZE;
+    unsigned new = align_up(size, SECTOR_SIZE) / SECTOR_SIZE;
+    return fs_used_sectors - old + new + 2 <= DISK_MAX_SIZE / SECTOR_SIZE;
+}
+
+/*
+    파일 이름 -> 파일 객체 해시 인덱스 (FNV-1a, 선형 탐사 open addressing)
+    삭제된 칸은 FS_INDEX_DELETED로 남겨 탐사가 끊기지 않게 하고, 사용 중인 칸과 삭제된 칸이 3/4을 넘으면 두 배 크기로 다시 만든다.
+    마운트(fs_init) 시 한 번에 만들고 fs_create, fs_delete에서 갱신한다.
+*/
+struct file **fs_index;
+unsigned fs_index_cap;   // 칸 수 (2의 거듭제곱)
+unsigned fs_index_count; // 파일이 들어있는 칸 수
+unsigned fs_index_used;  // 파일이 들어있거나 삭제된 칸 수
+
+uint32_t fs_hash(const char *name){
+    uint32_t hash = 2166136261u;
+    while(*name){
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// file은 이미 파일 목록에 연결되어 있어야 한다. (file_alloc)
+void fs_index_insert(struct file *file){
+    // 다시 만들 때 목록의 모든 파일을 넣으므로 file도 이미 들어간다. 여기서 또 넣으면 같은 파일이 두 칸에 들어간다.
+    if((fs_index_used + 1) * 4 > fs_index_cap * 3){
+        fs_index_rebuild(fs_index_count + 1);
+        return;
+    }
+
+    unsigned i = fs_hash(file->name) & (fs_index_cap - 1);
+    while(fs_index[i] && fs_index[i] != FS_INDEX_DELETED){
+        i = (i + 1) & (fs_index_cap - 1);
+    }
+
+    if(!fs_index[i]){
+        fs_index_used++;
+    }
+    fs_index[i] = file;
+    fs_index_count++;
+}
+
+void fs_index_remove(struct file *file){
+    unsigned i = fs_hash(file->name) & (fs_index_cap - 1);
+    while(fs_index[i]){
+        if(fs_index[i] == file){
+            fs_index[i] = FS_INDEX_DELETED;
+            fs_index_count--;
+            return;
         }
+        i = (i + 1) & (fs_index_cap - 1);
+    }
+
+    PANIC("fs_index_remove: %s is not indexed", file->name);
+}
+
+// 최소 count개의 파일을 담을 수 있는 크기로 인덱스를 새로 만들고 파일 목록의 모든 파일을 다시 넣는다.
+void fs_index_rebuild(unsigned count){
+    if(fs_index){
+        free_pages((paddr_t) fs_index, fs_index_cap * sizeof(struct file *) / PAGE_SIZE);
+    }
+
+    fs_index_cap = PAGE_SIZE / sizeof(struct file *);
+    while(count * 2 > fs_index_cap){
+        fs_index_cap *= 2;
+    }
+
+    fs_index = (struct file **) alloc_pages(fs_index_cap * sizeof(struct file *) / PAGE_SIZE);
+    fs_index_count = fs_index_used = 0;
+    for (struct file *file = file_head; file; file = file->next){
+        fs_index_insert(file);
+    }
+}
 
-        struct tar_header *header = (struct tar_header *)&disk[off];
-        memset(header, 0, sizeof(*header));
-        strcpy(header->name, file->name);
-        strcpy(header->mode, "000644");
-        strcpy(header->magic, "ustar");
-        strcpy(header->version, "00");
-        header->type = '0';
+// 아카이브 끝에 빈 파일을 만든다. 디스크에는 다음 fs_flush에서 기록된다.
+struct file *fs_create(const char *filename){
+    if(strlen(filename) >= FILE_NAME_MAX || fs_used_sectors + 1 + 2 > DISK_MAX_SIZE / SECTOR_SIZE){
+        return NULL;
+    }
+
+    struct file *file = file_alloc();
+    strcpy(file->name, filename);
+    file->loaded = true;
+    file->sector = fs_end_sector;
+    file->header_dirty = true;
+    fs_used_sectors++;
+    fs_index_insert(file);
+    return file;
+}
 
-        // Turn the file size into an octal string.
-        int filesz = file->size;
-        for (int i = sizeof(header->size); i>0;i--){
-            header->size[i - 1] = (filesz % 8) + '0';
-            filesz /= 8;
+/*
+    파일을 목록과 인덱스에서 빼고 메모리를 반환한다. 뒤의 파일들은 다음 fs_flush에서 앞으로 당겨진다.
+    뒤의 파일을 읽지 못하면 당길 수 없으므로 삭제하지 않고 -1을 반환한다.
+*/
+int fs_delete(struct file *file){
+    // 뒤의 파일들이 옛 위치에서 읽을 수 있도록 먼저 읽어둔다.
+    for (struct file *f = file->next; f; f = f->next){
+        if(fs_load(f) < 0){
+            return -1;
         }
+    }
+
+    struct file *prev = NULL;
+    for (struct file *f = file_head; f != file; f = f->next){
+        prev = f;
+    }
+
+    if(prev){
+        prev->next = file->next;
+    } else {
+        file_head = file->next;
+    }
+    if(file_tail == file){
+        file_tail = prev;
+    }
 
-        // Calculate the checksum
-        int checksum = ' ' * sizeof(header->checksum);
-        for (unsigned i = 0; i < sizeof(struct tar_header); i++){
-            checksum += (unsigned char) disk[off + i];
+    fs_index_remove(file);
+    fs_resize(file, 0);
+    fs_used_sectors--;
+    if(file->pages){
+        free_pages((paddr_t) file->pages, file->pages_cap * sizeof(paddr_t) / PAGE_SIZE);
+    }
+    file->in_use = false;
+    file->next = file_free_list;
+    file_free_list = file;
+    return 0;
+}
+
+/*
+    파일 내용을 아직 읽지 않았다면 디스크에서 읽어온다. 읽기에 실패하면 -1을 반환하고 다음 호출에서 다시 읽는다.
+    bread가 잠드는 동안 다른 프로세스가 파일을 읽거나 자르지 못하도록 fs_lock을 잡고 호출해야 하며,
+    loaded는 모든 섹터를 복사한 뒤에 설정한다.
+*/
+int fs_load(struct file *file){
+    if(file->loaded){
+        return 0;
+    }
+
+    size_t size = file->size;
+    fs_reserve_pages(file, align_up(size, PAGE_SIZE) / PAGE_SIZE);
+
+    unsigned nsectors = align_up(size, SECTOR_SIZE) / SECTOR_SIZE;
+    bcache_prefetch(file->sector + 1, nsectors);
+    for (unsigned i = 0; i < nsectors; i++){
+        struct buf *b = bread(file->sector + 1 + i);
+        if(!b){
+            return -1;
         }
 
-        for (int i=5; i>=0; i--){
-            header->checksum[i] = (checksum % 8) + '0';
-            checksum /= 8;
+        unsigned off = i * SECTOR_SIZE;
+        unsigned len = size - off < SECTOR_SIZE ? size - off : SECTOR_SIZE;
+        memcpy((void *) (file->pages[off / PAGE_SIZE] + off % PAGE_SIZE), b->data, len);
+        brelse(b);
+    }
+
+    file->loaded = true;
+    return 0;
+}
+
+// 파일의 tar 헤더를 만들어 버퍼 캐시에 기록한다. 버퍼를 얻지 못하면(다른 버퍼의 기록 실패) -1을 반환한다.
+int fs_write_header(struct file *file){
+    struct buf *b = bget(file->sector);
+    if(!b){
+        return -1;
+    }
+
+    struct tar_header *header = (struct tar_header *) b->data;
+    memset(header, 0, sizeof(*header));
+    strcpy(header->name, file->name);
+    strcpy(header->mode, "000644");
+    strcpy(header->magic, "ustar");
+    strcpy(header->version, "00");
+    header->type = '0';
+
+    // Turn the file size into an octal string.
+    int filesz = file->size;
+    for (int i = sizeof(header->size); i>0;i--){
+        header->size[i - 1] = (filesz % 8) + '0';
+        filesz /= 8;
+    }
+
+    // Calculate the checksum
+    int checksum = ' ' * sizeof(header->checksum);
+    for (unsigned i = 0; i < sizeof(struct tar_header); i++){
+        checksum += b->data[i];
+    }
+
+    for (int i=5; i>=0; i--){
+        header->checksum[i] = (checksum % 8) + '0';
+        checksum /= 8;
+    }
+
+    bwrite(b);
+    brelse(b);
+    return 0;
+}
+
+// 파일 데이터 중 index번째 섹터를 버퍼 캐시에 기록한다. 파일 크기를 넘는 부분은 0으로 채운다.
+int fs_write_data_sector(struct file *file, unsigned index){
+    struct buf *b = bget(file->sector + 1 + index);
+    if(!b){
+        return -1;
+    }
+
+    unsigned off = index * SECTOR_SIZE;
+    unsigned len = file->size - off < SECTOR_SIZE ? file->size - off : SECTOR_SIZE;
+    memcpy(b->data, (void *) (file->pages[off / PAGE_SIZE] + off % PAGE_SIZE), len);
+    memset(b->data + len, 0, SECTOR_SIZE - len);
+    bwrite(b);
+    brelse(b);
+    return 0;
+}
+
+// 파일의 [off, off + len) 영역이 바뀌었음을 표시한다. 크기가 바뀌었으면 헤더도 다시 기록해야 한다.
+void fs_mark_dirty(struct file *file, size_t off, size_t len){
+    file->gen = ++fs_gen;
+    if(file->dirty_end <= file->dirty_start){
+        file->dirty_start = off;
+        file->dirty_end = off + len;
+    } else {
+        if(off < file->dirty_start){
+            file->dirty_start = off;
         }
-        
-        // Copy file data
-        memcpy(header->data, file->data, file->size);
-        off += align_up(sizeof(struct tar_header) + file->size, SECTOR_SIZE);
+        if(off + len > file->dirty_end){
+            file->dirty_end = off + len;
+        }
+    }
+
+    if(file->size != file->disk_size){
+        file->header_dirty = true;
+    }
+}
+
+/*
+    바뀐 부분만 디스크에 기록한다.
+    tar 아카이브에서 파일은 헤더와 데이터가 순서대로 빈틈없이 이어져 있으므로 각 파일의 위치(sector)를 앞에서부터 다시 계산한다.
+    - 위치가 그대로인 파일은 헤더(크기가 바뀐 경우)와 바뀐 데이터 섹터만 기록한다.
+    - 앞 파일의 섹터 수가 바뀌어 위치가 밀린 파일은 헤더와 데이터 전체를 새 위치에 기록한다.
+    - 아카이브의 끝이 바뀌면 끝 표시(0으로 채운 섹터 2개)를 새로 기록한다.
+    헤더의 체크섬도 다시 기록하는 헤더에 대해서만 계산한다. 실제 디스크 기록은 bsync가 섹터 순으로 묶어서 처리한다.
+    디스크 기록에 실패하면 -1을 반환한다. 기록하지 못한 버퍼와 파일은 dirty로 남으므로 다음 fs_flush가 다시 기록한다.
+*/
+int fs_flush(void){
+    unsigned sector = 0, written = 0;
+
+    // 위치가 바뀌는 파일은 다른 파일이 옛 위치를 덮어쓰기 전에 내용을 모두 읽어둔다.
+    for (struct file *file = file_head; file; file = file->next){
+        if(file->sector != sector && fs_load(file) < 0){
+            printf("fs: cannot relocate %s, flush skipped\n", file->name);
+            return -1;
+        }
+        sector += 1 + align_up(file->size, SECTOR_SIZE) / SECTOR_SIZE;
+    }
+
+    sector = 0;
+    for (struct file *file = file_head; file; file = file->next){
+        unsigned nsectors = align_up(file->size, SECTOR_SIZE) / SECTOR_SIZE;
+        if(file->sector != sector){
+            // 앞 파일의 크기가 바뀌어 위치가 밀렸다.
+            file->sector = sector;
+            file->header_dirty = true;
+            file->dirty_start = 0;
+            file->dirty_end = file->size;
+        }
+
+        if(file->header_dirty){
+            if(fs_write_header(file) < 0){
+                return -1;
+            }
+            file->disk_size = file->size;
+            file->header_dirty = false;
+            written++;
+        }
+
+        if(file->dirty_end > file->size){
+            file->dirty_end = file->size;
+        }
+
+        if(file->dirty_end > file->dirty_start){
+            for (unsigned i = file->dirty_start / SECTOR_SIZE; i < align_up(file->dirty_end, SECTOR_SIZE) / SECTOR_SIZE; i++){
+                if(fs_write_data_sector(file, i) < 0){
+                    return -1;
+                }
+                written++;
+            }
+        }
+
+        file->dirty_start = file->dirty_end = 0;
+        sector += 1 + nsectors;
+    }
+
+    if(sector != fs_end_sector){
+        for (unsigned i = 0; i < 2; i++){
+            struct buf *b = bget(sector + i);
+            if(!b){
+                return -1;
+            }
+            memset(b->data, 0, SECTOR_SIZE);
+            bwrite(b);
+            brelse(b);
+        }
+        fs_end_sector = sector;
+        written += 2;
+    }
+
+    if(bsync() < 0){
+        return -1;
+    }
+    printf("wrote %d sectors to disk\n", written);
+    return 0;
+}
+
+// proc의 비어 있는 디스크립터에 of를 연결하고 디스크립터 번호를 반환한다.
+int fd_alloc(struct process *proc, struct open_file *of){
+    for (int fd = FD_FIRST; fd < FD_MAX; fd++){
+        if(!proc->fds[fd]){
+            proc->fds[fd] = of;
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+struct open_file *fd_get(struct process *proc, int fd){
+    if(fd < 0 || fd >= FD_MAX){
+        return NULL;
     }
 
-    // Write 'disk' bufer into the virtio-blk
-    for(unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++){
-        read_write_disk(&disk[sector * SECTOR_SIZE], sector, true);
+    return proc->fds[fd];
+}
+
+/*
+    디스크립터 하나를 닫는다. 마지막 디스크립터였다면 쓰기 내용을 디스크에 반영하고, 기록에 실패하면 -1을 반환한다.
+    refcnt가 0이 되면 fs_flush가 잠든 사이 다른 open이 이 항목을 가져갈 수 있으므로 먼저 항목을 비운다.
+*/
+int file_close(struct open_file *of){
+    if(--of->refcnt > 0){
+        return 0;
     }
 
-    printf("wrote %d bytes to disk\n", sizeof(disk));
+    struct file *file = of->file;
+    bool written = (of->flags & O_ACCMODE) != O_RDONLY;
+    of->file = NULL;
+
+    int ret = 0;
+    fs_lock();
+    file->nopen--;
+    if(written){
+        ret = fs_flush();
+    }
+    fs_unlock();
+    return ret;
+}
+
+void close_fds(struct process *proc){
+    for (int fd = 0; fd < FD_MAX; fd++){
+        if(proc->fds[fd]){
+            file_close(proc->fds[fd]);
+            proc->fds[fd] = NULL;
+        }
+    }
 }
 
 /*
@@ -156,24 +632,234 @@ struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4, lo
     return (struct sbiret){.error = a0, .value = a1};
 }
 /*
-    long sbi_console_putchar(int ch)
-    ch에 있는 데이터를 콘솔 디버깅에 쓴다. sbi_console_getchar()와 달리 이 SBI 호출은 전송할 대기 중인 문자가 남아 있거나 수신 터미널이 아직 바이트를 수신할 준비가 되지 않은 경우 차단된다.
-    그러나 콘솔이 전혀 존재하지 않으면 문자가 버려진다. 
-    이 SBI 호출은 성공시 0을 반환하거나 구현에 따라 에러 코드를 반환
-    -> 디버그 콘솔에 전송
+    NS16550A UART 드라이버
+    예전에는 SBI 콘솔 호출(ecall)로 한 글자씩 주고받았기 때문에 글자마다 M-Mode를 거쳐야 했고, 입력이 올 때까지 폴링해야 했다.
+    이제는 송신/수신 링 버퍼를 두고 UART 인터럽트로 처리한다.
+    - 송신: putchar는 링에 넣기만 하고, 송신 FIFO가 비면(THRE) 최대 16바이트씩 FIFO로 옮긴다. 링이 비어 있지 않으면 THRI 인터럽트를 켜 둔다.
+    - 수신: 수신 인터럽트가 오면 RBR을 모두 읽어 라인 규칙(tty_input)에 넘긴다.
+    uart_init 이전(부팅 초기)에는 링을 거치지 않고 송신 FIFO를 직접 폴링한다.
 */
-void putchar(char ch){
-    sbi_call(ch, 0, 0, 0, 0, 0, 0, 1 /* Console Putchar */);
+struct uart_ring uart_tx;
+bool uart_ready = false;
+
+void uart_write8(unsigned reg, uint8_t value){
+    *((volatile uint8_t *) (UART_PADDR + reg)) = value;
+}
+
+uint8_t uart_read8(unsigned reg){
+    return *((volatile uint8_t *) (UART_PADDR + reg));
+}
+
+void uart_init(void){
+    uart_write8(UART_IER, 0);
+    uart_write8(UART_LCR, UART_LCR_8N1);
+    uart_write8(UART_FCR, UART_FCR_ENABLE);
+    uart_write8(UART_MCR, UART_MCR_OUT2);
+    uart_write8(UART_IER, UART_IER_RDI);
+    uart_ready = true;
+    plic_enable(UART_IRQ);
+}
+
+// 송신 FIFO가 비어 있으면 링에서 최대 FIFO 크기만큼 옮긴다. 링에 남은 데이터가 있으면 THRI 인터럽트를 켠다.
+void uart_tx_kick(void){
+    if(uart_read8(UART_LSR) & UART_LSR_THRE){
+        for(int i = 0; i < UART_FIFO_SIZE && uart_tx.tail != uart_tx.head; i++){
+            uart_write8(UART_THR, uart_tx.buf[uart_tx.tail++ % UART_RING_SIZE]);
+        }
+    }
+
+    uart_write8(UART_IER, uart_tx.tail != uart_tx.head ? UART_IER_RDI | UART_IER_THRI : UART_IER_RDI);
+}
+
+// 송신 링이 빌 때까지 폴링한다. (링이 가득 찼을 때, PANIC)
+void uart_flush(void){
+    while(uart_tx.tail != uart_tx.head){
+        while((uart_read8(UART_LSR) & UART_LSR_THRE) == 0){}
+        uart_tx_kick();
+    }
+}
+
+void uart_putc(char ch){
+    if(!uart_ready){
+        while((uart_read8(UART_LSR) & UART_LSR_THRE) == 0){}
+        uart_write8(UART_THR, ch);
+        return;
+    }
+
+    if(uart_tx.head - uart_tx.tail == UART_RING_SIZE){
+        uart_flush();
+    }
+    uart_tx.buf[uart_tx.head++ % UART_RING_SIZE] = ch;
+}
+
+void uart_isr(void){
+    while(uart_read8(UART_LSR) & UART_LSR_DR){
+        tty_input(uart_read8(UART_RBR));
+    }
+    uart_tx_kick(); // 에코한 글자를 내보낸다.
 }
 
 /*
-    "input to the debug console"로부터 값을 읽는다. 입력이 없으면 -1을 리턴한다.
-    엄밀히 말하면 SBI는 키보드에서 문자를 읽는 것이 아니라 직렬포트에서 문자를 익는다. 
-    키보드 또는(QEMU의 표준 입력)가 직렬 포트와 연결되어 있기때문에 동작한다.
+    콘솔 라인 규칙 (canonical mode)
+    사용자 프로그램이 글자마다 getchar/putchar 시스템 콜을 호출하지 않도록 줄 편집은 커널이 인터럽트 처리 중에 한다.
+    - 입력한 글자는 바로 에코한다.
+    - 백스페이스(BS, DEL)는 편집 중인 줄의 마지막 글자를 지우고 화면에서도 지운다.
+    - 시리얼 콘솔의 엔터는 \r이므로 \n으로 바꾼다.
+    줄이 끝나면(\n) 편집 버퍼를 tty_cooked 링으로 옮기고 기다리던 프로세스를 깨운다.
+    따라서 tty_cooked에는 항상 완성된 줄만 들어 있다.
 */
+char tty_line[TTY_LINE_MAX];
+int tty_line_len;
+struct uart_ring tty_cooked;
+
+void tty_input(char ch){
+    if(ch == '\r'){
+        ch = '\n';
+    }
+
+    if(ch == '\b' || ch == 0x7f){
+        if(tty_line_len > 0){
+            tty_line_len--;
+            uart_putc('\b');
+            uart_putc(' ');
+            uart_putc('\b');
+        }
+        return;
+    }
+
+    if(ch == '\n'){
+        uart_putc('\n');
+        // 완성된 줄이 링에 들어가지 않으면 줄 전체를 버린다.
+        if(tty_cooked.head - tty_cooked.tail + tty_line_len + 1 <= UART_RING_SIZE){
+            for(int i = 0; i < tty_line_len; i++){
+                tty_cooked.buf[tty_cooked.head++ % UART_RING_SIZE] = tty_line[i];
+            }
+            tty_cooked.buf[tty_cooked.head++ % UART_RING_SIZE] = '\n';
+            proc_wakeup(&tty_cooked);
+        }
+        tty_line_len = 0;
+        return;
+    }
+
+    // 그 밖의 제어 문자와 편집 버퍼를 넘는 글자는 무시한다.
+    if((uint8_t) ch < ' ' || tty_line_len == TTY_LINE_MAX){
+        return;
+    }
+    tty_line[tty_line_len++] = ch;
+    uart_putc(ch);
+}
+
+// 커널 printf용. 출력이 링에 남아 있지 않도록 글자마다 송신을 시작한다.
+void putchar(char ch){
+    uart_putc(ch);
+    uart_tx_kick();
+}
+
+// 완성된 줄에서 한 글자를 꺼낸다. 입력이 없으면 -1을 리턴한다.
 int getchar(void){
-    struct sbiret ret = sbi_call(0, 0, 0, 0, 0, 0, 0, 2);
-    return ret.error;
+    if(tty_cooked.tail == tty_cooked.head){
+        return -1;
+    }
+    return (uint8_t) tty_cooked.buf[tty_cooked.tail++ % UART_RING_SIZE];
+}
+
+// 콘솔에 len 바이트를 출력한다.
+int console_write(const char *buf, int len){
+    for (int i = 0; i < len; i++){
+        uart_putc(buf[i]);
+    }
+    uart_tx_kick();
+    return len;
+}
+
+/*
+    콘솔에서 최대 len 바이트를 읽는다. 완성된 줄이 없으면 한 줄이 입력될 때까지 잠들고,
+    한 번에 한 줄(\n 포함)까지만 읽는다.
+*/
+int console_read(char *buf, int len){
+    while(tty_cooked.tail == tty_cooked.head){
+        proc_sleep(&tty_cooked);
+    }
+
+    int n = 0;
+    while(n < len){
+        int ch = getchar();
+        buf[n++] = ch;
+        if(ch == '\n'){
+            break;
+        }
+    }
+    return n;
+}
+
+/*
+    한 줄을 읽어 \n 없이 NULL로 끝나는 문자열로 buf에 저장하고 길이를 반환한다.
+    줄이 len - 1 바이트보다 길면 줄 전체를 버리고 -1을 반환한다.
+*/
+int tty_readline(char *buf, int len){
+    while(tty_cooked.tail == tty_cooked.head){
+        proc_sleep(&tty_cooked);
+    }
+
+    int n = 0;
+    bool overflow = false;
+    for(;;){
+        int ch = getchar();
+        if(ch == '\n'){
+            break;
+        }
+
+        if(n < len - 1){
+            buf[n++] = ch;
+        } else {
+            overflow = true;
+        }
+    }
+
+    buf[n] = '\0';
+    return overflow ? -1 : n;
+}
+
+/*
+    time CSR은 64비트 카운터이고 RV32에서는 time(하위 32비트)과 timeh(상위 32비트)로 나눠 읽는다.
+    두 번 읽는 사이에 하위 32비트가 넘칠 수 있으므로 timeh가 바뀌지 않을 때까지 다시 읽는다.
+*/
+uint64_t read_time(void){
+    uint32_t hi, lo;
+    do {
+        hi = READ_CSR(timeh);
+        lo = READ_CSR(time);
+    } while (hi != READ_CSR(timeh));
+
+    return ((uint64_t) hi << 32) | lo;
+}
+
+/*
+    SBI Timer Extension (EID 0x54494D45 "TIME"), FID 0: sbi_set_timer(uint64_t stime_value)
+    time이 stime_value에 도달하면 S-Mode 타이머 인터럽트(sip.STIP)가 발생한다. 다시 호출하면 대기 중인 인터럽트가 지워진다.
+    RV32에서는 64비트 인자를 a0(하위), a1(상위)로 나눠 전달한다.
+*/
+void sbi_set_timer(uint64_t stime_value){
+    sbi_call(stime_value & 0xffffffff, stime_value >> 32, 0, 0, 0, 0, 0, SBI_EXT_TIME);
+}
+
+// 다음 프로세스에 할당된 시간 조각(time_slice)이 끝나는 시점에 타이머 인터럽트가 발생하도록 설정한다.
+void timer_arm(struct process *proc){
+    if(proc == idle_proc){
+        // 유휴 프로세스는 선점할 필요가 없다.
+        sbi_set_timer(~0ull);
+        return;
+    }
+
+    sbi_set_timer(read_time() + proc->time_slice);
+}
+
+// 프로세스가 CPU를 사용한 시간을 누적한다. 64비트 나눗셈(__udivdi3)을 피하려고 ms 단위와 나머지 tick으로 나눠 저장한다.
+void account_runtime(struct process *proc, uint32_t now){
+    proc->runtime_ticks += now - proc->last_start;
+    proc->runtime_ms += proc->runtime_ticks / TIMER_TICKS_PER_MS;
+    proc->runtime_ticks %= TIMER_TICKS_PER_MS;
+    proc->last_start = now;
 }
 
 /*
@@ -227,12 +913,14 @@ struct process procs[PROCS_MAX]; //All process control structures
 
 __attribute__((naked)) void user_entry(void){
     __asm__ __volatile__(
-        "csrw sepc, %[sepc] \n" /* sepc 레지스터에서 U-Mode로 전환할 때의 프로그램 카운터를 설정, sret가 점프하는 위치 */
+        "csrw sepc, s0 \n" /* sepc 레지스터에서 U-Mode로 전환할 때의 프로그램 카운터(ELF 진입점, create_process가 s0에 넣어둔다)를 설정, sret가 점프하는 위치 */
+        "mv a0, s1 \n" /* argc, argv (spawn이 s1, s2에 넣어둔다) */
+        "mv a1, s2 \n"
         // 현재 구현에서는 하드웨어 인터럽트를 사용하지 않고 폴링을 사용하므로 SPIE 비트를 설정할 필요는 없음
         "csrw sstatus, %[sstatus]\n" /* sstatus 레지스터에서 SPIE 비트를 설정 -> U-Mode에 진입할 때 하드웨어 인터럽트가 활성화되고 stvec 레지스터에 설정된 핸들러가 호출*/
         "sret \n" /* S-Mode에서 U-Mode로의 전환은 sret 명령으로 수해욈*/
         :
-        :   [sepc] "r" (USER_BASE),
+        :
         /*
             Read the RISC-V specification carefully. It does mention that "when the SUM bit is set, S-Mode can access U-Mode pages."
             https://github.com/qemu/qemu/blob/d1181d29370a4318a9f11ea92065bea6bb159f83/target/riscv/cpu_helper.c#L1008
@@ -243,9 +931,23 @@ __attribute__((naked)) void user_entry(void){
 }
 
 /*
-    MMIO 레지스터에 엑세스하는 것은 일반 메모리에 엑세스하는 것과는 다름
-    컴파일러가 읽기/쓰기 작업을 최적화하지 못하도록 휘발성 키워드를 사용 
-    MMIO에서 메모리 엑세스 부작용(장치에 명령 전송)을 유발할 수 있음
+    fork된 자식 프로세스의 첫 번째 컨텍스트 전환의 점프 대상.
+    switch_context가 복원한 s0에 돌아갈 사용자 pc가 들어 있고, sp는 부모에게서 복사한 트랩 프레임을 가리킨다.
+*/
+__attribute__((naked)) void fork_ret(void){
+    __asm__ __volatile__(
+        "csrw sepc, s0\n"
+        "csrw sstatus, %[sstatus]\n"
+        "j trap_return\n"
+        :
+        :   [sstatus] "r" (SSTATUS_SPIE | SSTATUS_SUM)
+    );
+}
+
+/*
+    MMIO 레지스터에 엑세스하는 것은 일반 메모리에 엑세스하는 것과는 다름
+    컴파일러가 읽기/쓰기 작업을 최적화하지 못하도록 휘발성 키워드를 사용 
+    MMIO에서 메모리 엑세스 부작용(장치에 명령 전송)을 유발할 수 있음
 */
 uint32_t virtio_reg_read32(unsigned offset){
     return *((volatile uint32_t *) (VIRTIO_BLK_PADDR + offset));
@@ -282,9 +984,7 @@ void virtio_reg_fetch_and_or32(unsigned offset, uint32_t value) {
     8. DRIVER_OK 비트를 설정 한다. 디비아시그ㅏ "LIVE"
 */
 struct virtio_virtq *blk_request_vq;
-struct virtio_blk_req *blk_req;
-paddr_t blk_req_paddr;
-unsigned blk_capacity;
+struct blk_request blk_slots[BLK_REQS_MAX];
 
 void virtio_blk_init(void){
     if(virtio_reg_read32(VIRTIO_REG_MAGIC) != 0x74726976){
@@ -322,8 +1022,11 @@ void virtio_blk_init(void){
     printf("virtio-blk: capacity is %d bytes\n", blk_capacity);
 
     // Allocate a region to store requests to the device
-    blk_req_paddr = alloc_pages(align_up(sizeof(*blk_req), PAGE_SIZE) / PAGE_SIZE);
-    blk_req = (struct virtio_blk_req *)blk_req_paddr;
+    paddr_t reqs_paddr = alloc_pages(align_up(sizeof(struct virtio_blk_req) * BLK_REQS_MAX, PAGE_SIZE) / PAGE_SIZE);
+    for (int i = 0; i < BLK_REQS_MAX; i++){
+        blk_slots[i].vreq_paddr = reqs_paddr + i * sizeof(struct virtio_blk_req);
+        blk_slots[i].vreq = (struct virtio_blk_req *) blk_slots[i].vreq_paddr;
+    }
 }
 
 /*
@@ -349,6 +1052,13 @@ struct virtio_virtq *virtq_init(unsigned index){
     struct virtio_virtq *vq = (struct virtio_virtq *)virtq_paddr;
     vq->queue_index = index;
     vq->used_index = (volatile uint16_t *) &vq->used.index;
+
+    // 모든 디스크립터를 next 필드로 연결해 빈 디스크립터 리스트를 만든다.
+    for (int i = 0; i < VIRTQ_ENTRY_NUM; i++){
+        vq->descs[i].next = i + 1;
+    }
+    vq->free_head = 0;
+    vq->num_free = VIRTQ_ENTRY_NUM;
     
     // 1. Select the queue writing its index (first queue is 0) To QueueSel.
     virtio_reg_write32(VIRTIO_REG_QUEUE_SEL, index);
@@ -365,212 +1075,1217 @@ struct virtio_virtq *virtq_init(unsigned index){
 // of the head descriptor of the new request
 void virtq_kick(struct virtio_virtq *vq, int desc_index){
     vq->avail.ring[vq->avail.index % VIRTQ_ENTRY_NUM] = desc_index;
+    __sync_synchronize();
     vq->avail.index++;
     __sync_synchronize();
     virtio_reg_write32(VIRTIO_REG_QUEUE_NOTIFY, vq->queue_index);
-    vq->last_used_index++;
 }
 
-// Return whether there are requests being processed by the device
-bool virtq_is_busy(struct virtio_virtq *vq){
-    return vq->last_used_index != *vq->used_index;
+// 빈 디스크립터 리스트에서 하나를 꺼낸다. 남은 디스크립터가 없으면 -1
+int virtq_alloc_desc(struct virtio_virtq *vq){
+    if(vq->num_free == 0){
+        return -1;
+    }
+
+    int index = vq->free_head;
+    vq->free_head = vq->descs[index].next;
+    vq->num_free--;
+    return index;
+}
+
+// head부터 VIRTQ_DESC_F_NEXT로 이어진 디스크립터 체인을 빈 리스트에 돌려놓는다.
+void virtq_free_chain(struct virtio_virtq *vq, int head){
+    int index = head;
+    for (;;){
+        bool has_next = vq->descs[index].flags & VIRTQ_DESC_F_NEXT;
+        int next = vq->descs[index].next;
+        vq->descs[index].flags = 0;
+        vq->descs[index].next = vq->free_head;
+        vq->free_head = index;
+        vq->num_free++;
+
+        if(!has_next){
+            break;
+        }
+        index = next;
+    }
 }
 
-// Reads/Writes from/to virtio-blk device
-void read_write_disk(void *buf, unsigned sector, int is_write){
-    if(sector >= blk_capacity / SECTOR_SIZE){
-        printf("virtio: tried to read/write sector=%d, but capacity is %d\n", 
-                sector, blk_capacity / SECTOR_SIZE);
-        return;
+/*
+    여러 요청을 동시에 장치에 보낼 수 있도록 요청 슬롯(blk_slots)과 디스크립터를 추적한다.
+    요청 하나는 헤더, 데이터(하나 이상), 상태 디스크립터로 이루어진다.
+    장치는 used ring에 요청의 첫 번째 디스크립터 번호를 기록하므로 blk_desc_slot으로 완료된 요청 슬롯을 찾는다.
+
+    데이터 디스크립터는 호출자의 버퍼를 직접 가리키므로(DMA) 중간 버퍼로의 복사가 없다.
+    커널 영역은 vaddr == paddr로 매핑되어 있으므로 커널 버퍼의 주소를 그대로 물리 주소로 쓸 수 있고,
+    주소가 연속된 버퍼는 물리적으로도 연속이므로 여러 페이지에 걸쳐도 디스크립터 하나로 표현된다.
+
+    커널 코드는 인터럽트가 꺼진 상태(sstatus.SIE = 0)로 실행되므로 요청을 보내고 잠들기 전에 완료 인터럽트가 처리되어
+    깨우기를 놓치는 일은 없다.
+*/
+struct blk_request *blk_desc_slot[VIRTQ_ENTRY_NUM];
+
+// 요청이 끝나거나 슬롯이 빌 때까지 기다린다.
+void blk_wait(void *chan){
+    if(current_proc && current_proc != idle_proc){
+        proc_sleep(chan);
+    } else {
+        // 부팅 중(fs_init)이나 유휴 프로세스에서는 잠들 수 없으므로 인터럽트를 기다렸다가 직접 처리한다.
+        idle_wait();
     }
+}
 
-    // Construct the request according to the virtio-blk spec
-    blk_req->sector = sector;
-    blk_req->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    if(is_write){
-        memcpy(blk_req->data, buf, SECTOR_SIZE);
+// iov의 앞에서부터 요청 하나(데이터 디스크립터 BLK_SEGS_MAX개)에 담을 수 있는 항목 수를 반환한다. 주소가 이어지는 항목은 하나로 합친다.
+int blk_iov_fit(const struct blk_iov *iov, int iovcnt){
+    int segs = 0;
+    for (int i = 0; i < iovcnt; i++){
+        bool merged = i > 0 && (uint8_t *) iov[i - 1].base + iov[i - 1].len == iov[i].base;
+        if(!merged && ++segs > BLK_SEGS_MAX){
+            return i;
+        }
     }
 
-    // Construct the virtqueue descriptors (using 3 descriptors).
+    return iovcnt;
+}
+
+/*
+    sector부터 iov가 가리키는 버퍼들을 읽거나 쓰는 요청 하나를 장치에 보내고 바로 반환한다. 결과는 blk_finish로 받는다.
+    iov의 항목은 blk_iov_fit으로 확인한 만큼만 넘겨야 한다.
+    빈 슬롯이나 디스크립터가 없을 때 wait가 false이면 NULL을 반환한다. 이미 요청을 보내 놓은 호출자가 슬롯을 기다리며 잠들면
+    서로의 슬롯을 기다리는 교착 상태가 생길 수 있으므로, 그런 경우에는 자기 요청을 먼저 끝내야 한다. (read_write_disk_iov)
+*/
+struct blk_request *blk_submit(unsigned sector, const struct blk_iov *iov, int iovcnt, int is_write, bool wait){
     struct virtio_virtq *vq = blk_request_vq;
-    vq->descs[0].addr = blk_req_paddr;
-    vq->descs[0].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
-    vq->descs[0].flags = VIRTQ_DESC_F_NEXT;
-    vq->descs[0].next = 1;
+    int segs = 0;
+    for (int i = 0; i < iovcnt; i++){
+        paddr_t base = (paddr_t) iov[i].base;
+        if(base < (paddr_t) __kernel_base || base + iov[i].len > (paddr_t) __free_ram_end){
+            PANIC("virtio: buffer %x is not in kernel memory", base);
+        }
+
+        if(i == 0 || (uint8_t *) iov[i - 1].base + iov[i - 1].len != iov[i].base){
+            segs++;
+        }
+    }
+
+    struct blk_request *req = NULL;
+    for (;;){
+        for (int i = 0; i < BLK_REQS_MAX; i++){
+            if(!blk_slots[i].in_use){
+                req = &blk_slots[i];
+                break;
+            }
+        }
+
+        if(req && vq->num_free >= segs + 2){
+            break;
+        }
+
+        if(!wait){
+            return NULL;
+        }
+
+        req = NULL;
+        blk_wait(blk_slots);
+    }
+
+    req->in_use = true;
+    req->done = false;
+    req->sector = sector;
+    req->is_write = is_write;
+
+    // Construct the request according to the virtio-blk spec
+    struct virtio_blk_req *vreq = req->vreq;
+    vreq->sector = sector;
+    vreq->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    vreq->status = 0xff;
+
+    // First descriptor: request header
+    int head = virtq_alloc_desc(vq);
+    int prev = head;
+    vq->descs[head].addr = req->vreq_paddr;
+    vq->descs[head].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
+    vq->descs[head].flags = VIRTQ_DESC_F_NEXT;
+
+    // Data descriptors: one per physically contiguous range
+    for (int i = 0; i < iovcnt; i++){
+        if(i > 0 && (uint8_t *) iov[i - 1].base + iov[i - 1].len == iov[i].base){
+            vq->descs[prev].len += iov[i].len;
+            continue;
+        }
+
+        int d = virtq_alloc_desc(vq);
+        vq->descs[prev].next = d;
+        vq->descs[d].addr = (paddr_t) iov[i].base;
+        vq->descs[d].len = iov[i].len;
+        vq->descs[d].flags = VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
+        prev = d;
+    }
 
-    vq->descs[1].addr = blk_req_paddr + offsetof(struct virtio_blk_req, data);
-    vq->descs[1].len = SECTOR_SIZE;
-    vq->descs[1].flags = VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
-    vq->descs[1].next = 2;
+    // Last descriptor: status written by the device
+    int d = virtq_alloc_desc(vq);
+    vq->descs[prev].next = d;
+    vq->descs[d].addr = req->vreq_paddr + offsetof(struct virtio_blk_req, status);
+    vq->descs[d].len = sizeof(uint8_t);
+    vq->descs[d].flags = VIRTQ_DESC_F_WRITE;
 
-    vq->descs[2].addr = blk_req_paddr + offsetof(struct virtio_blk_req, status);
-    vq->descs[2].len = sizeof(uint8_t);
-    vq->descs[2].flags = VIRTQ_DESC_F_WRITE;
+    req->head = head;
+    blk_desc_slot[head] = req;
 
     // Notify the device that there is a new request
-    virtq_kick(vq, 0);
+    virtq_kick(vq, head);
+    return req;
+}
 
-    // Wait until the device finished processing.
-    while(virtq_is_busy(vq)){
+// 요청이 끝날 때까지 기다렸다가 결과를 확인하고 슬롯을 반환한다. 실패하면 -1
+int blk_finish(struct blk_request *req){
+    while(!req->done){
+        blk_wait(req);
     }
 
     // virtio-blk: If a non-zero value is returned, it's an error
-    if(blk_req->status != 0){
-        printf("virtio: warn: failed to read/write sector=%d status=%d\n", sector, blk_req->status);
-        return;
+    int status = req->vreq->status;
+    if(status != 0){
+        printf("virtio: warn: failed to read/write sector=%d status=%d\n", req->sector, status);
     }
 
-    // For read operations, copy the data into the buffer
-    if(!is_write){
-        memcpy(buf, blk_req->data, SECTOR_SIZE);
-    }
+    req->in_use = false;
+    proc_wakeup(blk_slots);
+    return status == 0 ? 0 : -1;
 }
 
-
-struct process *create_process(const void *image, size_t image_size){
-    // Find an unused process control structure.
-    struct process *proc = NULL; 
-    int i; 
-    for (i = 0;i < PROCS_MAX; i++){
-        if (procs[i].state == PROC_UNUSED){
-            proc = &procs[i];
-            break;
+/*
+    sector부터 iov가 가리키는 버퍼들(각각 SECTOR_SIZE의 배수)을 순서대로 읽거나 쓴다. (scatter-gather)
+    요청 하나에 담기지 않으면 여러 요청으로 나누고, 가능한 만큼 요청을 미리 보내 두어(파이프라인) 장치가 쉬지 않고 처리하도록 한다.
+*/
+int read_write_disk_iov(unsigned sector, const struct blk_iov *iov, int iovcnt, int is_write){
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++){
+        if(!is_aligned(iov[i].len, SECTOR_SIZE)){
+            PANIC("virtio: iov length %d is not a multiple of the sector size", iov[i].len);
         }
+        total += iov[i].len;
     }
 
-    if(!proc){
-        PANIC("no free process slots");
+    if(sector + total / SECTOR_SIZE > blk_capacity / SECTOR_SIZE){
+        printf("virtio: tried to read/write sector=%d count=%d, but capacity is %d\n", 
+                sector, total / SECTOR_SIZE, blk_capacity / SECTOR_SIZE);
+        return -1;
     }
 
-    uint32_t *sp = (uint32_t *)&proc->stack[sizeof(proc->stack)];
-    *--sp = 0;                      // s11
-    *--sp = 0;                      // s10
-    *--sp = 0;                      // s9
-    *--sp = 0;                      // s8
-    *--sp = 0;                      // s7
-    *--sp = 0;                      // s6
-    *--sp = 0;                      // s5
-    *--sp = 0;                      // s4
-    *--sp = 0;                      // s3
-    *--sp = 0;                      // s2
-    *--sp = 0;                      // s1
-    *--sp = 0;                      // s0
-    *--sp = (uint32_t ) user_entry; // ra
+    struct blk_request *inflight[BLK_REQS_MAX];
+    unsigned submitted = 0, completed = 0;
+    int next = 0, ret = 0;
+    while(next < iovcnt || completed < submitted){
+        if(next < iovcnt && submitted - completed < BLK_REQS_MAX){
+            int n = blk_iov_fit(&iov[next], iovcnt - next);
+            struct blk_request *req = blk_submit(sector, &iov[next], n, is_write, submitted == completed);
+            if(req){
+                inflight[submitted % BLK_REQS_MAX] = req;
+                submitted++;
+                for (int i = 0; i < n; i++){
+                    sector += iov[next + i].len / SECTOR_SIZE;
+                }
+                next += n;
+                continue;
+            }
+        }
 
-    // Map Kernel Pages. - 이건 왜 하는거지 음 
-    uint32_t *page_table = (uint32_t *) alloc_pages(1);
-    for (paddr_t paddr = (paddr_t) __kernel_base; paddr < (paddr_t) __free_ram_end; paddr += PAGE_SIZE){
-        map_page(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
+        if(blk_finish(inflight[completed % BLK_REQS_MAX]) < 0){
+            ret = -1;
+        }
+        completed++;
     }
 
-    /* 
-        먼저, 커널이 MMIO 레지스터에 접근할 수 있도록 virtio-blk MMIO 영역을 페이지 테이블에 매핑한다.
-    */
-    map_page(page_table, VIRTIO_BLK_PADDR, VIRTIO_BLK_PADDR, PAGE_R | PAGE_W);
+    return ret;
+}
 
-    /*
-        실행 이미지를 지정된 크기에 맞게 페이지별로 복사하여 프로세스의 페이지 테이블에 매핑한다.
-        첫 번째 컨텍스트 전환의 점프 대상을 user_entry로 설정한다.
+// Reads/Writes from/to virtio-blk device
+int read_write_disk(void *buf, unsigned sector, int is_write){
+    struct blk_iov iov = { .base = buf, .len = SECTOR_SIZE };
+    return read_write_disk_iov(sector, &iov, 1, is_write);
+}
 
-        실행 이미지를 복사하지 않고 직접 매핑하면 동일한 애플리케이션의 프로세스가 동일한 물리적 페이지를 공유하게됨 -> 메모밀 분리 실패
-    */
-    for (uint32_t off = 0; off < image_size; off += PAGE_SIZE){
-        paddr_t page = alloc_pages(1);
+// 연속된 count개의 섹터를 요청 하나로 읽고 쓴다.
+void read_write_disk_many(void *buf, unsigned sector, unsigned count, int is_write){
+    struct blk_iov iov = { .base = buf, .len = count * SECTOR_SIZE };
+    read_write_disk_iov(sector, &iov, 1, is_write);
+}
 
-        // Handle the case where the data to be copied is smaller than page size; 
-        size_t remaining = image_size - off;
-        size_t copy_size = PAGE_SIZE <= remaining ? PAGE_SIZE : remaining;
-    
-        memcpy((void*) page, image + off, copy_size); 
-        map_page(page_table, USER_BASE + off, page, PAGE_U | PAGE_R | PAGE_W | PAGE_X);
+/*
+    virtio-blk 인터럽트 핸들러
+    InterruptStatus의 비트 0은 used ring이 갱신되었음을, 비트 1은 설정 공간이 바뀌었음을 뜻한다.
+    InterruptACK에 같은 값을 써서 인터럽트를 확인(ack)한 뒤, 아직 처리하지 않은 used ring 항목을 거둬들여
+    디스크립터를 반환하고 해당 요청을 기다리는 프로세스를 깨운다.
+*/
+void virtio_blk_isr(void){
+    uint32_t status = virtio_reg_read32(VIRTIO_REG_INTERRUPT_STATUS);
+    virtio_reg_write32(VIRTIO_REG_INTERRUPT_ACK, status & 0x3);
+
+    struct virtio_virtq *vq = blk_request_vq;
+    while(vq->last_used_index != *vq->used_index){
+        __sync_synchronize();
+        struct virtq_used_elem *elem = &vq->used.ring[vq->last_used_index % VIRTQ_ENTRY_NUM];
+        struct blk_request *req = blk_desc_slot[elem->id];
+        vq->last_used_index++;
+
+        virtq_free_chain(vq, elem->id);
+        req->done = true;
+        proc_wakeup(req);
     }
 
-    proc->pid = i + 1;
-    proc->state = PROC_RUNNABLE;
-    proc->sp = (uint32_t )sp;
-    proc->page_table = page_table;
-    return proc;
+    // 디스크립터가 반환되었으므로 빈 슬롯을 기다리는 프로세스도 깨운다.
+    proc_wakeup(blk_slots);
 }
 
 /*
-Exception의 라이프
-1. CPU는 medelg 레지스터를 확인하여 예외를 처리할 동작 모드를 결정한다. 
-OpenSBI는 이미 S-Mode의 핸들러에서 U-Mode / S-Mode 예외를 처리하도록 구성한다.
+    PLIC (Platform-Level Interrupt Controller)
+    외부 장치의 인터럽트를 모아 각 hart의 컨텍스트에 전달한다. QEMU virt 머신에서 hart 0의 S-Mode 컨텍스트는 1번이다.
+    1. 인터럽트 소스마다 우선순위(1 이상)를 설정하고 컨텍스트의 enable 비트를 켠다.
+    2. 우선순위가 threshold보다 높은 인터럽트가 대기 중이면 sip.SEIP가 설정된다.
+    3. claim 레지스터를 읽으면 가장 우선순위가 높은 인터럽트 번호를 얻고(없으면 0), 처리가 끝나면 같은 번호를 써서 완료를 알린다.
+    https://github.com/riscv/riscv-plic-spec/blob/master/riscv-plic.adoc
+*/
+void plic_write32(paddr_t addr, uint32_t value){
+    *((volatile uint32_t *) addr) = value;
+}
 
-2. CPU는 자신의 상태(레지스터)를 다양한 CSR에 저장한다.
-scause : 예외 유형, 커널은 이를 읽고 예외 유형을 식별한다.
-stval : 예외에 대한 추가 정보(예외를 발생시킨 메모리 주소), 예외 유형에 따라 다름
-sepc : 예외가 발생한 지점의 프로그램 카운터
-sstatus : 예외가 발생한 경우 작동 모드(u or s)
+uint32_t plic_read32(paddr_t addr){
+    return *((volatile uint32_t *) addr);
+}
 
-3. stvec 레지스터의 값은 프로그램 카운터로 설정되어 커널의 예외 처리기로 이동한다.
+void plic_enable(unsigned irq){
+    plic_write32(PLIC_PRIORITY(irq), 1);
+    plic_write32(PLIC_SENABLE, plic_read32(PLIC_SENABLE) | (1u << irq));
+}
 
-4. 예외 처리기는 범용 레지스터(즉, 프로그램 상태)를 저장하고 예외를 처리함
+void plic_init(void){
+    plic_write32(PLIC_STHRESHOLD, 0);
+    plic_enable(VIRTIO_BLK_IRQ);
+    WRITE_CSR(sie, READ_CSR(sie) | SIE_SEIE);
+}
 
-5. 완료되면 예외 처리기는 저장된 실행 상태를 복원하고 sret 명령을 호출하여 예외가 발생한 지점부터 실행을 재개한다. 
+// 대기 중인 외부 인터럽트를 모두 처리한다.
+void handle_external_irq(void){
+    uint32_t irq;
+    while((irq = plic_read32(PLIC_SCLAIM)) != 0){
+        switch(irq){
+            case VIRTIO_BLK_IRQ:
+                virtio_blk_isr();
+                break;
+            case UART_IRQ:
+                uart_isr();
+                break;
+            default:
+                printf("plic: unexpected irq %d\n", irq);
+        }
+
+        plic_write32(PLIC_SCLAIM, irq);
+    }
+}
+
+/*
+    인터럽트를 기다렸다가 처리한다. (유휴 프로세스, 부팅 중)
+    커널은 sstatus.SIE = 0으로 실행되므로 트랩은 발생하지 않지만, sie에서 활성화된 인터럽트가 대기 중이면 wfi는 반환된다.
+    따라서 wfi 이후에 대기 중인 인터럽트를 직접 처리한다.
 */
+void idle_wait(void){
+    __asm__ __volatile__("wfi");
+    handle_external_irq();
+}
 
 /*
-sscratch 레지스터는 예외 발생시 스택포인터를 저장하는 임시 저장소로 사용, 나중에 복원
+    프로세스 재우기/깨우기
+    chan은 무엇을 기다리는지 나타내는 임의의 주소이다. (xv6의 sleep/wakeup과 같은 방식)
+    잠든 프로세스는 실행 큐에서 빠지고, proc_wakeup이 같은 chan으로 호출되면 다시 실행 큐에 들어간다.
+*/
+void proc_sleep(void *chan){
+    current_proc->wait_chan = chan;
+    current_proc->state = PROC_BLOCKED;
+    yield();
+}
 
-부동소수점 레지스터는 커널 내에서 사용되지 않으므로 여기에 저장할 필요가 없음. 일반적으로 스레드 전환 중에 저장되고 복원됨
+void proc_wakeup(void *chan){
+    for (int i = 0; i < PROCS_MAX; i++){
+        struct process *proc = &procs[i];
+        if(proc->state == PROC_BLOCKED && proc->wait_chan == chan){
+            proc->wait_chan = NULL;
+            proc->state = PROC_RUNNABLE;
+            rq_push(proc);
+        }
+    }
+}
 
-스택포인터가 a0 레지스터에 설정되고 handle_trap 함수가 호출됨. 이떄 스택포인터가 가리키는 주소에는 나중에 설명하는 trap_frame 구조와 동일한 구조에 저장된 레지스터 값이 포함됨
+/*
+    버퍼 캐시
+    파일 시스템과 read_write_disk 사이에서 최근에 사용한 섹터를 메모리에 보관한다.
+    - 섹터 번호 -> 버퍼는 해시 테이블(체이닝)로 찾는다.
+    - 모든 버퍼는 LRU 리스트에 연결되어 있고, 사용이 끝난(refcnt == 0) 버퍼는 맨 앞(가장 최근)으로 옮긴다.
+      새 섹터를 위한 버퍼가 필요하면 리스트의 맨 뒤부터 사용 중이 아닌 버퍼를 골라 재사용한다.
+    - 쓰기는 버퍼를 dirty로 표시만 하고(write-back) bsync에서 섹터 번호 순으로 정렬해 연속된 섹터를 묶어 기록한다.
+      dirty 버퍼가 교체 대상이 되면 먼저 디스크에 기록한다.
+    캐시 크기는 부팅 시 남은 메모리의 1/BCACHE_RAM_DIV로 정한다.
+*/
+struct buf *bcache_bufs;
+struct buf **bcache_sorted;         // bsync에서 dirty 버퍼를 정렬할 때 사용
+struct buf *bcache_hash[BCACHE_HASH_SIZE];
+struct buf *bcache_lru_head;         // 가장 최근에 사용한 버퍼
+struct buf *bcache_lru_tail;         // 가장 오래전에 사용한 버퍼
+unsigned bcache_nbuf;
+struct bcache_stats bcache_stats;
+
+void bcache_init(void){
+    unsigned pages = free_page_count() / BCACHE_RAM_DIV;
+    bcache_nbuf = pages * (PAGE_SIZE / SECTOR_SIZE);
+
+    uint8_t *data = (uint8_t *) alloc_pages(pages);
+    bcache_bufs = (struct buf *) alloc_pages(align_up(sizeof(struct buf) * bcache_nbuf, PAGE_SIZE) / PAGE_SIZE);
+    bcache_sorted = (struct buf **) alloc_pages(align_up(sizeof(struct buf *) * bcache_nbuf, PAGE_SIZE) / PAGE_SIZE);
+
+    for (unsigned i = 0; i < bcache_nbuf; i++){
+        struct buf *b = &bcache_bufs[i];
+        b->data = &data[i * SECTOR_SIZE];
+        b->lru_prev = i > 0 ? &bcache_bufs[i - 1] : NULL;
+        b->lru_next = i + 1 < bcache_nbuf ? &bcache_bufs[i + 1] : NULL;
+    }
+    bcache_lru_head = &bcache_bufs[0];
+    bcache_lru_tail = &bcache_bufs[bcache_nbuf - 1];
 
-__attribute((align(4)))을 추가하면 함수의 시작 주소가 4바이트 경계에 정렬됨
-이는 stvec 레지스터가 예외 핸들러의 주소를 보유할 뿐만 아니라 하단 2비트에 모드를 나타내는 플래그를 가지고 있음
+    printf("bcache: %d buffers (%d KB)\n", bcache_nbuf, bcache_nbuf * SECTOR_SIZE / 1024);
+}
 
-기존의 예외처리기는 실행 상태를 스택에 저장함. 
-하지만 이제 각 프로세스마다 별도의 커널 스택을 사용하기 떄문에 프로세스 전환 시 sscratch 레지스터에 현재 실행중인 프로세스의 커널 스택 초기값을 설정
-*/
+struct buf *bcache_lookup(unsigned sector){
+    for (struct buf *b = bcache_hash[sector % BCACHE_HASH_SIZE]; b; b = b->hash_next){
+        if(b->valid_sector && b->sector == sector){
+            return b;
+        }
+    }
 
-/*
-    csrrw 명령어
-    tmp = sp; 
-    sp = sscratch;
-    sscratch = tmp;
+    return NULL;
+}
 
-    sp는 현재 실행 중인 프로세스의 커널(사용자 스택이 아닌) 스택을 가리킨다. 예외가 발생한 시점의 sp(사용자 스택)의 원래 값을 sscratch가 보유한다.
-    다른 레지스터를 커널 스택에 저장한 후, 원래 sp 값을 복원하고 이를 커널 스택에 저장. 그런 다음 sscratch의 초기 값을 계산하여 복원.
-    여기서 중요한 점은 프로세스가 독립적인 커널 스택을 가진다는 것. 컨텍스트 전환 중에 sscratch의 내용을 바꾸면 아무 일도 없었다는 것처럼 프로세스가 중단된 지점부터 실행을 재개할 수 있음
+void bcache_hash_remove(struct buf *b){
+    struct buf **p = &bcache_hash[b->sector % BCACHE_HASH_SIZE];
+    while(*p != b){
+        p = &(*p)->hash_next;
+    }
+    *p = b->hash_next;
+}
+
+// 버퍼를 LRU 리스트의 맨 앞으로 옮긴다.
+void bcache_lru_touch(struct buf *b){
+    if(bcache_lru_head == b){
+        return;
+    }
+
+    // unlink
+    b->lru_prev->lru_next = b->lru_next;
+    if(b->lru_next){
+        b->lru_next->lru_prev = b->lru_prev;
+    } else {
+        bcache_lru_tail = b->lru_prev;
+    }
+
+    // push front
+    b->lru_prev = NULL;
+    b->lru_next = bcache_lru_head;
+    bcache_lru_head->lru_prev = b;
+    bcache_lru_head = b;
+}
+
+// dirty 버퍼 하나를 바로 디스크에 기록한다. 기록하는 동안 다른 곳에서 교체하지 못하도록 참조를 잡아 둔다.
+int bcache_writeback(struct buf *b){
+    b->refcnt++;
+    b->dirty = false;
+    int ret = read_write_disk(b->data, b->sector, true);
+    if(ret < 0){
+        // 기록하지 못한 내용을 잃지 않도록 다시 dirty로 표시한다.
+        printf("bcache: failed to write back sector %d\n", b->sector);
+        b->dirty = true;
+    } else {
+        bcache_stats.writebacks++;
+    }
+    b->refcnt--;
+    return ret;
+}
+
+/*
+    sector에 해당하는 버퍼를 참조(refcnt++)해서 반환한다. 캐시에 없으면 LRU 리스트의 맨 뒤에서 사용 중이 아닌 버퍼를 골라
+    sector에 할당한다. 이때 valid가 false이므로 호출자가 내용을 채워야 한다.
+    골라낸 dirty 버퍼를 디스크에 기록하지 못하면 NULL을 반환한다.
+    다른 프로세스가 같은 버퍼를 디스크에서 읽는 중이면(busy) 끝날 때까지 기다린다.
 */
+struct buf *bget(unsigned sector){
+    for (;;){
+        struct buf *b = bcache_lookup(sector);
+        if(b){
+            b->refcnt++;
+            while(b->busy){
+                blk_wait(b);
+            }
+            return b;
+        }
+
+        struct buf *victim = NULL;
+        for (b = bcache_lru_tail; b; b = b->lru_prev){
+            if(b->refcnt == 0 && !b->busy){
+                victim = b;
+                break;
+            }
+        }
+
+        if(!victim){
+            PANIC("bcache: no free buffers");
+        }
+
+        // dirty 버퍼는 먼저 기록한다. 기록하는 동안 잠들 수 있으므로 처음부터 다시 찾는다.
+        // 기록에 실패하면 버퍼를 내줄 수 없으므로 NULL을 반환한다.
+        if(victim->dirty){
+            if(bcache_writeback(victim) < 0){
+                return NULL;
+            }
+            continue;
+        }
+
+        if(victim->valid_sector){
+            bcache_hash_remove(victim);
+            bcache_stats.evictions++;
+        }
+
+        victim->sector = sector;
+        victim->valid_sector = true;
+        victim->valid = false;
+        victim->refcnt = 1;
+        victim->hash_next = bcache_hash[sector % BCACHE_HASH_SIZE];
+        bcache_hash[sector % BCACHE_HASH_SIZE] = victim;
+        return victim;
+    }
+}
+
+// sector의 내용을 담은 버퍼를 반환한다. 사용이 끝나면 brelse를 호출해야 한다. 디스크에서 읽지 못하면 NULL을 반환한다.
+struct buf *bread(unsigned sector){
+    struct buf *b = bget(sector);
+    if(!b){
+        return NULL;
+    }
+
+    if(b->valid){
+        bcache_stats.hits++;
+        return b;
+    }
+
+    bcache_stats.misses++;
+    b->busy = true;
+    int ret = read_write_disk(b->data, sector, false);
+    b->valid = ret == 0;
+    b->busy = false;
+    proc_wakeup(b);
+    if(ret < 0){
+        // 버퍼는 invalid로 남겨 두므로 다음 bread가 다시 읽는다.
+        brelse(b);
+        return NULL;
+    }
+    return b;
+}
+
+// 버퍼의 내용이 바뀌었음을 표시한다. 실제 기록은 bsync나 교체될 때 이루어진다. (write-back)
+void bwrite(struct buf *b){
+    b->valid = true;
+    b->dirty = true;
+}
+
+void brelse(struct buf *b){
+    if(b->refcnt <= 0){
+        PANIC("brelse: buffer for sector %d is not referenced", b->sector);
+    }
+
+    if(--b->refcnt == 0){
+        bcache_lru_touch(b);
+    }
+}
 
 /*
-    sscratch를 조정하여 커널 스택으로 전환해야 하는 이유
-    예외 발생 시 스택포인터를 신뢰해서는 안된다. 예외 처리기에는 다음 3가지 패턴을 고려해야딤
-    1. 커널 모드에서 예외가 발생한 경우
-    2. 커널모드에서 다른 예외(중첩 예외)를 처리할 때 예외가 발생한 경우
-    3. 사용자 모드에서 예외가 발생한 경우 
+    [sector, sector + count) 중 캐시에 없는 섹터를 미리 읽어 둔다.
+    연속해서 빠진 섹터들을 모아 요청 하나(scatter-gather)로 읽으므로 섹터마다 bread로 읽는 것보다 장치 왕복이 적다.
+*/
+void bcache_prefetch(unsigned sector, unsigned count){
+    struct blk_iov iov[BCACHE_IOV_MAX];
+    struct buf *bufs[BCACHE_IOV_MAX];
+    int n = 0;
+    unsigned start = 0;
+    for (unsigned s = sector; s <= sector + count; s++){
+        struct buf *b = NULL;
+        if(s < sector + count){
+            b = bget(s);
+            if(b && b->valid){
+                brelse(b);
+                b = NULL;
+            }
+        }
 
-    1번의 경우 스택 포인터를 재설정하지 않아도 문제 없음
-    2번의 경우 저장된 영역을 덮어쓰지만, 중첩 예외에 대한 커널 패닉을 트리거 하는 구현이므로 괜찮음
+        // 연속이 끊기거나 모을 수 있는 만큼 모았으면 한 번에 읽는다.
+        if(n > 0 && (!b || n == BCACHE_IOV_MAX)){
+            // 실패하면 invalid로 남겨 두고, 필요할 때 bread가 다시 읽어서 오류를 알린다.
+            int ret = read_write_disk_iov(start, iov, n, false);
+            for (int i = 0; i < n; i++){
+                bufs[i]->valid = ret == 0;
+                bufs[i]->busy = false;
+                proc_wakeup(bufs[i]);
+                brelse(bufs[i]);
+            }
+            bcache_stats.misses += n;
+            n = 0;
+        }
 
-    3번의 경우 sp는 사용자(어플리케이션) 스택 영역을 가리킴. sp를 그대로 사용(신뢰)하도록 구현하면 커널이 충돌하는 취약점이 발생할 수 있음
-    만약 sscratch를 조정하지 않는다면 예외 발생시 스택 포인터가 매핑되지 않은 주소(userland)를 가리키기 때문에 이에 대한 또다른 예외를 불러옴
-    -> 무한루프로 커널 중단 -> 즉, 신뢰할 수 있는 스택 영역을 처음부터 다시 가져와야 함
+        if(b){
+            if(n == 0){
+                start = s;
+            }
+            b->busy = true;
+            bufs[n] = b;
+            iov[n].base = b->data;
+            iov[n].len = SECTOR_SIZE;
+            n++;
+        }
+    }
+}
+
+/*
+    dirty 버퍼를 모두 디스크에 기록한다.
+    섹터 번호 순으로 정렬한 뒤 번호가 이어지는 버퍼들을 요청 하나로 묶어 기록한다.
 */
-__attribute__((naked))
-__attribute__((aligned(4)))
-void kernel_entry(void){
-    __asm__ __volatile__(
-        // 실행 중인 프로세스의 커널 스택을 처음부터 다시 가져온다.
-        "csrrw sp, sscratch, sp\n"
-        "addi sp, sp, -4 * 31\n"
-        "sw ra, 4 * 0(sp)\n"
-        "sw gp, 4 * 1(sp)\n"
-        "sw tp, 4 * 2(sp)\n"
-        "sw t0, 4 * 3(sp)\n"
-        "sw t1, 4 * 4(sp)\n"
-        "sw t2, 4 * 5(sp)\n"
-        "sw t3, 4 * 6(sp)\n"
-        "sw t4, 4 * 7(sp)\n"
-        "sw t5,  4 * 8(sp)\n"
-        "sw t6,  4 * 9(sp)\n"
-        "sw a0,  4 * 10(sp)\n"
-        "sw a1,  4 * 11(sp)\n"
-        "sw a2,  4 * 12(sp)\n"
-        "sw a3,  4 * 13(sp)\n"
-        "sw a4,  4 * 14(sp)\n"
+int bsync(void){
+    int n = 0, ret = 0;
+    for (unsigned i = 0; i < bcache_nbuf; i++){
+        struct buf *b = &bcache_bufs[i];
+        if(b->dirty){
+            b->refcnt++;
+            b->dirty = false;
+            bcache_sorted[n++] = b;
+        }
+    }
+
+    // shell sort by sector
+    for (int gap = n / 2; gap > 0; gap /= 2){
+        for (int i = gap; i < n; i++){
+            struct buf *tmp = bcache_sorted[i];
+            int j = i;
+            for (; j >= gap && bcache_sorted[j - gap]->sector > tmp->sector; j -= gap){
+                bcache_sorted[j] = bcache_sorted[j - gap];
+            }
+            bcache_sorted[j] = tmp;
+        }
+    }
+
+    struct blk_iov iov[BCACHE_IOV_MAX];
+    int start = 0;
+    for (int i = 0; i <= n; i++){
+        bool contiguous = i < n && i > start && i - start < BCACHE_IOV_MAX
+                          && bcache_sorted[i]->sector == bcache_sorted[i - 1]->sector + 1;
+        if(i > start && !contiguous){
+            for (int j = start; j < i; j++){
+                iov[j - start].base = bcache_sorted[j]->data;
+                iov[j - start].len = SECTOR_SIZE;
+            }
+            if(read_write_disk_iov(bcache_sorted[start]->sector, iov, i - start, true) < 0){
+                // 기록하지 못한 버퍼는 다시 dirty로 표시해서 다음 bsync가 다시 기록하게 한다.
+                printf("bcache: failed to write sectors %d-%d\n", bcache_sorted[start]->sector, bcache_sorted[i - 1]->sector);
+                for (int j = start; j < i; j++){
+                    bcache_sorted[j]->dirty = true;
+                }
+                ret = -1;
+            }
+            start = i;
+        }
+    }
+
+    for (int i = 0; i < n; i++){
+        if(!bcache_sorted[i]->dirty){
+            bcache_stats.writebacks++;
+        }
+        brelse(bcache_sorted[i]);
+    }
+    return ret;
+}
+
+void dump_bcache_stats(void){
+    unsigned lookups = bcache_stats.hits + bcache_stats.misses;
+    printf("bcache: buffers=%d hits=%d misses=%d hit_rate=%d%% evictions=%d writebacks=%d\n",
+           bcache_nbuf, bcache_stats.hits, bcache_stats.misses,
+           lookups ? bcache_stats.hits * 100 / lookups : 0,
+           bcache_stats.evictions, bcache_stats.writebacks);
+}
+
+uint32_t read_cycle(void){
+    uint32_t cycle;
+    __asm__ __volatile__("rdcycle %0" : "=r"(cycle));
+    return cycle;
+}
+
+// which: 0 = memcpy, 1 = memset, 2 = strcpy, 3 = strcmp 를 size 바이트로 MEMBENCH_BYTES만큼 반복하고 바이트/사이클을 출력한다.
+void membench_run(int which, uint8_t *src, uint8_t *dst, int size){
+    // 문자열 함수는 size - 1 글자 + NULL을 처리한다.
+    memset(src, 'a', size - 1);
+    src[size - 1] = '\0';
+    strcpy((char *) dst, (const char *) src);
+
+    int reps = MEMBENCH_BYTES / size;
+    uint32_t start = read_cycle();
+    for (int i = 0; i < reps; i++){
+        switch(which){
+            case 0: memcpy(dst, src, size); break;
+            case 1: memset(dst, i, size); break;
+            case 2: strcpy((char *) dst, (const char *) src); break;
+            case 3: strcmp((const char *) dst, (const char *) src); break;
+        }
+        // 결과를 사용하지 않는 호출이 최적화로 없어지지 않게 한다.
+        __asm__ __volatile__("" ::: "memory");
+    }
+    uint32_t cycles = read_cycle() - start;
+
+    // printf는 %d만 지원하므로 바이트 * 100 / 사이클을 소수점 둘째 자리까지 출력한다. (64비트 나눗셈을 피하기 위해 32비트로 계산)
+    uint32_t rate = cycles ? (uint32_t) (reps * size) * 100 / cycles : 0;
+    printf("\t%d.%d%d", rate / 100, rate / 10 % 10, rate % 10);
+}
+
+/*
+    크기(8B ~ 64KB)별로 각 함수의 바이트/사이클을 출력한다.
+    커널 코드는 인터럽트가 꺼진 상태로 실행되므로 측정 중에 선점되지 않는다.
+*/
+void dump_membench(void){
+    unsigned npages = MEMBENCH_MAX / PAGE_SIZE;
+    uint8_t *src = (uint8_t *) alloc_pages(npages);
+    uint8_t *dst = (uint8_t *) alloc_pages(npages);
+#ifdef __riscv_vector
+    printf("membench (rvv): bytes/cycle\n");
+#else
+    printf("membench (scalar): bytes/cycle\n");
+#endif
+    printf("size\tmemcpy\tmemset\tstrcpy\tstrcmp\n");
+    for (int size = MEMBENCH_MIN; size <= MEMBENCH_MAX; size *= 2){
+        printf("%d", size);
+        for (int which = 0; which < 4; which++){
+            membench_run(which, src, dst, size);
+        }
+        printf("\n");
+    }
+    free_pages((paddr_t) src, npages);
+    free_pages((paddr_t) dst, npages);
+}
+
+/*
+    빈(또는 종료된) 프로세스 슬롯을 찾아 공통 필드를 초기화한다.
+    페이지 테이블, 커널 스택, 실행 큐 등록은 호출자(create_process, fork)가 한다.
+    pid는 슬롯 번호가 아니라 계속 증가하는 값이므로, 슬롯이 재사용되어도 이전 프로세스의 pid로 새 프로세스를 가리키지 않는다.
+*/
+int next_pid;
+
+struct process *proc_alloc(void){
+    struct process *proc = NULL; 
+    int i; 
+    for (i = 0;i < PROCS_MAX; i++){
+        if (procs[i].state == PROC_UNUSED || procs[i].state == PROC_EXITED){
+            proc = &procs[i];
+            break;
+        }
+    }
+
+    if(!proc){
+        return NULL;
+    }
+
+    proc->pid = ++next_pid;
+    proc->priority = PRIO_DEFAULT;
+    proc->asid = 0;
+    proc->asid_gen = 0; // 처음 실행될 때 asid_assign에서 ASID를 할당받는다.
+    proc->time_slice = TIME_SLICE_DEFAULT;
+    proc->runtime_ms = 0;
+    proc->runtime_ticks = 0;
+    proc->nr_switches = 0;
+    proc->nr_preempts = 0;
+    proc->create_ticks = 0;
+    memset(proc->fds, 0, sizeof(proc->fds));
+    proc->mmap_next = MMAP_BASE;
+    proc->nvmas = 0;
+    proc->image = NULL;
+    return proc;
+}
+
+// 실행 중인(종료되지 않은) pid 프로세스를 찾는다. 없으면 NULL (유휴 프로세스의 pid는 -1이므로 찾지 않는다)
+struct process *proc_lookup(int pid){
+    if(pid <= 0){
+        return NULL;
+    }
+
+    for (int i = 0; i < PROCS_MAX; i++){
+        struct process *proc = &procs[i];
+        if(proc->pid == pid && proc->state != PROC_UNUSED && proc->state != PROC_EXITED){
+            return proc;
+        }
+    }
+    return NULL;
+}
+
+/*
+    실행 이미지(ELF) 캐시. 같은 이미지로 만든 프로세스들은 쓰기 불가능한 세그먼트(.text/.rodata)의 페이지를 공유한다.
+    공유 페이지는 이미지를 처음 불러올 때 한 번만 복사한다.
+    이미지의 참조 수(refcnt)는 이 이미지로 실행 중인 프로세스 수에 캐시에 있으면(cached) 1을 더한 값이다.
+    캐시에 있는 동안은 프로세스가 모두 종료되어도 반환되지 않고, 파일이 바뀌거나 지워졌을 때 또는 빈 칸이 필요할 때 캐시에서 빠진다.
+    커널에 포함된 이미지(shell)는 캐시에서 빠지지 않는다.
+*/
+struct image images[IMAGES_MAX];
+
+// ELF 세그먼트 권한(PF_*)을 페이지 권한(PAGE_*)으로 바꾼다.
+uint32_t elf_page_flags(uint32_t p_flags){
+    return (p_flags & PF_R ? PAGE_R : 0) | (p_flags & PF_W ? PAGE_W : 0) | (p_flags & PF_X ? PAGE_X : 0);
+}
+
+/*
+    ELF32 실행 파일을 검사하고 PT_LOAD 세그먼트로 이미지를 만든다. 잘못된 파일이면 NULL을 반환한다.
+    - 쓰기 불가능한 세그먼트: 공유 페이지를 만들어 파일 내용을 복사한다. 같은 페이지에 걸친 세그먼트(.text와 .rodata)는 권한을 합친다.
+    - 쓰기 가능한 세그먼트: VMA 틀만 만든다. 프로세스가 처음 접근할 때 p_filesz까지는 파일에서 복사하고 p_memsz까지의 나머지는 0으로 남긴다.
+    W^X: 쓰기와 실행 권한을 함께 가진 세그먼트나, 쓰기 가능한 세그먼트와 쓰기 불가능한 세그먼트가 같은 페이지를 쓰는 파일은 거부한다.
+    data는 이미지가 캐시에 있는 동안 유지되어야 한다.
+*/
+struct image *image_load(const void *data, size_t size){
+    for (int i = 0; i < IMAGES_MAX; i++){
+        if(images[i].data == data){
+            return &images[i];
+        }
+    }
+
+    const struct elf32_ehdr *ehdr = data;
+    if(size < sizeof(*ehdr) || ehdr->e_ident[0] != 0x7f || ehdr->e_ident[1] != 'E' || ehdr->e_ident[2] != 'L' || ehdr->e_ident[3] != 'F'
+       || ehdr->e_ident[4] != ELFCLASS32 || ehdr->e_ident[5] != ELFDATA2LSB || ehdr->e_type != ET_EXEC || ehdr->e_machine != EM_RISCV
+       || ehdr->e_phentsize != sizeof(struct elf32_phdr)
+       || !is_aligned(ehdr->e_phoff, 4) || ehdr->e_phoff > size || ehdr->e_phnum > (size - ehdr->e_phoff) / sizeof(struct elf32_phdr)){
+        printf("elf: invalid header\n");
+        return NULL;
+    }
+
+    /*
+        디스크의 ELF는 사용자가 만들 수 있으므로 모든 범위 검사는 더해서 넘치지 않도록 뺄셈으로 한다.
+        범위 검사를 모두 통과한 뒤에 세그먼트끼리 페이지가 겹치는지 검사한다.
+    */
+    const struct elf32_phdr *phdrs = (const struct elf32_phdr *) ((const uint8_t *) data + ehdr->e_phoff);
+    unsigned npages = 0, nwritable = 0;
+    for (int i = 0; i < ehdr->e_phnum; i++){
+        const struct elf32_phdr *ph = &phdrs[i];
+        if(ph->p_type != PT_LOAD || ph->p_memsz == 0){
+            continue;
+        }
+
+        if(ph->p_filesz > ph->p_memsz || ph->p_filesz > size || ph->p_offset > size - ph->p_filesz
+           || ph->p_vaddr < USER_BASE || ph->p_vaddr >= USER_END || ph->p_memsz > USER_END - ph->p_vaddr){
+            printf("elf: invalid segment %d\n", i);
+            return NULL;
+        }
+
+        if((ph->p_flags & PF_W) && (ph->p_flags & PF_X)){
+            printf("elf: segment %d is writable and executable\n", i);
+            return NULL;
+        }
+
+        if(ph->p_flags & PF_W){
+            nwritable++;
+        } else {
+            npages += (align_up(ph->p_vaddr + ph->p_memsz, PAGE_SIZE) - (ph->p_vaddr & ~(PAGE_SIZE - 1))) / PAGE_SIZE;
+        }
+    }
+
+    /*
+        쓰기 가능한 세그먼트는 다른 어떤 세그먼트와도 페이지를 공유할 수 없다.
+        - 읽기 전용 세그먼트와 겹치면 공유 페이지에 쓰기가 가능해진다.
+        - 다른 쓰기 가능한 세그먼트와 겹치면 vma_find가 첫 번째 VMA만 찾으므로 두 번째 세그먼트의 내용이 빠진다.
+    */
+    for (int i = 0; i < ehdr->e_phnum; i++){
+        const struct elf32_phdr *ph = &phdrs[i];
+        if(ph->p_type != PT_LOAD || ph->p_memsz == 0 || !(ph->p_flags & PF_W)){
+            continue;
+        }
+
+        vaddr_t start = ph->p_vaddr & ~(PAGE_SIZE - 1);
+        vaddr_t end = align_up(ph->p_vaddr + ph->p_memsz, PAGE_SIZE);
+        for (int j = 0; j < ehdr->e_phnum; j++){
+            const struct elf32_phdr *other = &phdrs[j];
+            if(j == i || other->p_type != PT_LOAD || other->p_memsz == 0){
+                continue;
+            }
+
+            if(start < align_up(other->p_vaddr + other->p_memsz, PAGE_SIZE) && (other->p_vaddr & ~(PAGE_SIZE - 1)) < end){
+                printf("elf: writable segment %d shares a page with segment %d\n", i, j);
+                return NULL;
+            }
+        }
+    }
+
+    if(nwritable > IMAGE_SEGS_MAX){
+        printf("elf: too many writable segments\n");
+        return NULL;
+    }
+
+    struct image *img = NULL;
+    for (int i = 0; i < IMAGES_MAX; i++){
+        if(!images[i].data){
+            img = &images[i];
+            break;
+        }
+    }
+
+    if(!img){
+        printf("elf: image cache is full\n");
+        return NULL;
+    }
+
+    img->data = data;
+    img->path[0] = '\0';
+    img->refcnt = 1;
+    img->cached = true;
+    img->size = size;
+    img->entry = ehdr->e_entry;
+    img->end = USER_BASE;
+    img->npages = 0;
+    img->nvmas = 0;
+    unsigned table_pages = align_up(npages * sizeof(struct image_page), PAGE_SIZE) / PAGE_SIZE;
+    img->pages = table_pages ? (struct image_page *) alloc_pages(table_pages) : NULL;
+    img->pages_cap = npages;
+
+    for (int i = 0; i < ehdr->e_phnum; i++){
+        const struct elf32_phdr *ph = &phdrs[i];
+        if(ph->p_type != PT_LOAD || ph->p_memsz == 0){
+            continue;
+        }
+
+        vaddr_t start = ph->p_vaddr & ~(PAGE_SIZE - 1);
+        vaddr_t end = align_up(ph->p_vaddr + ph->p_memsz, PAGE_SIZE);
+        if(end > img->end){
+            img->end = end;
+        }
+
+        if(ph->p_flags & PF_W){
+            struct vma *vma = &img->vmas[img->nvmas++];
+            vma->start = start;
+            vma->end = end;
+            vma->flags = elf_page_flags(ph->p_flags);
+            vma->src = (const uint8_t *) data + ph->p_offset;
+            vma->src_vaddr = ph->p_vaddr;
+            vma->src_size = ph->p_filesz;
+            continue;
+        }
+
+        for (vaddr_t va = start; va < end; va += PAGE_SIZE){
+            struct image_page *ip = NULL;
+            for (unsigned j = 0; j < img->npages; j++){
+                if(img->pages[j].vaddr == va){
+                    ip = &img->pages[j];
+                    break;
+                }
+            }
+
+            if(!ip){
+                ip = &img->pages[img->npages++];
+                ip->vaddr = va;
+                ip->paddr = alloc_pages(1);
+                ip->flags = 0;
+            }
+            ip->flags |= elf_page_flags(ph->p_flags);
+
+            // [p_vaddr, p_vaddr + p_filesz) 중 이 페이지에 걸치는 부분만 복사한다. 나머지(.bss)는 0이다.
+            vaddr_t copy_start = va > ph->p_vaddr ? va : ph->p_vaddr;
+            vaddr_t copy_end = va + PAGE_SIZE < ph->p_vaddr + ph->p_filesz ? va + PAGE_SIZE : ph->p_vaddr + ph->p_filesz;
+            if(copy_start < copy_end){
+                memcpy((void *) (ip->paddr + copy_start - va), (const uint8_t *) data + ph->p_offset + (copy_start - ph->p_vaddr), copy_end - copy_start);
+            }
+        }
+    }
+
+    return img;
+}
+
+/*
+    tar 디스크에 있는 실행 파일로 이미지를 만든다.
+    이미지의 쓰기 가능한 세그먼트는 프로세스가 접근할 때마다 파일 내용을 복사하므로 파일 전체를 연속된 페이지에 읽어 두고 이미지가 계속 사용한다.
+    한 번 불러온 이미지는 경로로 캐시해 두므로 같은 프로그램을 다시 실행할 때는 디스크 읽기와 ELF 해석을 건너뛴다.
+    파일이 바뀌었으면(file->gen) 새로 불러온다. 이전 이미지는 캐시에서 빼고, 이미 실행 중인 프로세스가 모두 종료되면 반환된다.
+    파일 객체는 fs_delete 이후 재사용되므로 struct file 주소가 아니라 경로와 gen(모든 파일에서 유일한 값)으로 같은 내용인지 확인한다.
+    파일을 읽는 동안 잠들 수 있으므로 fs_lock을 잡고 호출한다.
+*/
+struct image *image_open(const char *path){
+    struct file *file = fs_lookup(path);
+    if(!file || file->size == 0){
+        return NULL;
+    }
+
+    // 파일이 바뀌었거나 지워진 이미지를 캐시에서 뺀다.
+    struct image *found = NULL;
+    for (int i = 0; i < IMAGES_MAX; i++){
+        struct image *img = &images[i];
+        if(!img->data || !img->cached || img->path[0] == '\0'){
+            continue;
+        }
+
+        struct file *f = fs_lookup(img->path);
+        if(!f || f->gen != img->file_gen){
+            img->cached = false;
+            image_put(img);
+        } else if(f == file){
+            found = img;
+        }
+    }
+
+    if(found){
+        return found;
+    }
+
+    // 빈 칸이 없으면 실행 중인 프로세스가 없는 이미지를 하나 캐시에서 빼서 반환한다.
+    bool has_free = false;
+    for (int i = 0; i < IMAGES_MAX && !has_free; i++){
+        has_free = !images[i].data;
+    }
+    for (int i = 0; i < IMAGES_MAX && !has_free; i++){
+        struct image *img = &images[i];
+        if(img->cached && img->refcnt == 1 && img->path[0] != '\0'){
+            img->cached = false;
+            image_put(img);
+            has_free = true;
+        }
+    }
+
+    unsigned npages = align_up(file->size, PAGE_SIZE) / PAGE_SIZE;
+    void *data = (void *) alloc_pages(npages);
+    if(fs_read(file, 0, data, file->size) < 0){
+        free_pages((paddr_t) data, npages);
+        return NULL;
+    }
+
+    struct image *img = image_load(data, file->size);
+    if(!img){
+        free_pages((paddr_t) data, npages);
+        return NULL;
+    }
+
+    strcpy(img->path, path);
+    img->file_gen = file->gen;
+    return img;
+}
+
+// 이미지의 참조를 놓는다. 마지막 참조였다면 공유 페이지와 (디스크에서 불러온 경우) ELF 데이터를 반환한다.
+void image_put(struct image *img){
+    if(!img || --img->refcnt > 0){
+        return;
+    }
+
+    for (unsigned i = 0; i < img->npages; i++){
+        page_put(img->pages[i].paddr);
+    }
+    if(img->pages){
+        free_pages((paddr_t) img->pages, align_up(img->pages_cap * sizeof(struct image_page), PAGE_SIZE) / PAGE_SIZE);
+    }
+    if(img->path[0] != '\0'){
+        free_pages((paddr_t) img->data, align_up(img->size, PAGE_SIZE) / PAGE_SIZE);
+    }
+    img->data = NULL;
+    img->pages = NULL;
+}
+
+/*
+    path의 프로그램으로 새 프로세스를 만들고 argv(NULL로 끝나는 배열)를 전달한다.
+    인자는 ARGS_BASE에 매핑한 페이지에 포인터 배열과 문자열 순서로 복사하고, user_entry가 argc/argv를 a0/a1로 넘겨 main(argc, argv)가 받는다.
+    argv는 현재 프로세스의 주소 공간에 있는 포인터이다.
+*/
+struct process *spawn(const char *path, char **argv){
+    fs_lock();
+    struct image *img = image_open(path);
+    fs_unlock();
+    if(!img){
+        return NULL;
+    }
+
+    paddr_t args = alloc_pages(1);
+    char **uargv = (char **) args;
+    size_t off = sizeof(char *) * (ARGS_MAX + 1);
+    int argc = 0;
+    for (; argv; argc++){
+        if(!user_check(current_proc, (vaddr_t) &argv[argc], sizeof(char *), false)){
+            free_pages(args, 1);
+            return NULL;
+        }
+
+        if(!argv[argc]){
+            break;
+        }
+
+        // 인자 페이지에 남은 공간까지만 복사한다.
+        int len = argc == ARGS_MAX ? -1 : user_copy_str(current_proc, (char *) (args + off), (vaddr_t) argv[argc], PAGE_SIZE - off);
+        if(len < 0){
+            free_pages(args, 1);
+            return NULL;
+        }
+
+        uargv[argc] = (char *) (ARGS_BASE + off);
+        off += len + 1;
+    }
+    uargv[argc] = NULL;
+
+    struct process *proc = create_process(img);
+    if(!proc){
+        free_pages(args, 1);
+        return NULL;
+    }
+
+    map_page(proc->page_table, ARGS_BASE, args, PAGE_U | PAGE_R | PAGE_W);
+    uint32_t *sp = (uint32_t *) proc->sp;
+    sp[2] = argc;       // s1
+    sp[3] = ARGS_BASE;  // s2
+    return proc;
+}
+
+struct process *create_process(struct image *img){
+    // 프로세스 생성 지연 시간 측정용 (time CSR, QEMU virt에서 10MHz)
+    uint32_t start_time = READ_CSR(time);
+
+    // Find an unused process control structure.
+    struct process *proc = proc_alloc();
+    if(!proc){
+        printf("no free process slots\n");
+        return NULL;
+    }
+
+    uint32_t *sp = (uint32_t *)&proc->stack[sizeof(proc->stack)];
+    *--sp = 0;                      // s11
+    *--sp = 0;                      // s10
+    *--sp = 0;                      // s9
+    *--sp = 0;                      // s8
+    *--sp = 0;                      // s7
+    *--sp = 0;                      // s6
+    *--sp = 0;                      // s5
+    *--sp = 0;                      // s4
+    *--sp = 0;                      // s3
+    *--sp = 0;                      // s2
+    *--sp = 0;                      // s1
+    *--sp = 0;                      // s0
+    *--sp = (uint32_t ) user_entry; // ra
+
+    /*
+        커널 영역과 MMIO 영역은 모든 프로세스가 동일하게 매핑하므로 부팅 시 한 번 만들어 둔 kernel_page_table의
+        1단계 항목을 그대로 복사한다. 2단계 페이지 테이블과 메가페이지 항목은 모든 프로세스가 공유하게 된다.
+    */
+    uint32_t *page_table = (uint32_t *) alloc_pages(1);
+    memcpy(page_table, kernel_page_table, PAGE_SIZE);
+
+    /*
+        - 쓰기 불가능한 세그먼트: 이미지 캐시의 공유 페이지를 세그먼트 권한 그대로 매핑한다.
+        - 쓰기 가능한 세그먼트(.data/.bss, 스택 포함): 처음 접근할 때 개인 페이지를 할당하는 VMA로 등록한다.
+        - [마지막 세그먼트 끝, USER_END): 0으로 채우는 영역 (힙 등)
+        따라서 프로세스를 하나 더 만들 때 필요한 메모리는 실제로 사용하는 쓰기 가능한 페이지뿐이다.
+    */
+    if(img){
+        for (unsigned i = 0; i < img->npages; i++){
+            page_get(img->pages[i].paddr);
+            map_page(page_table, img->pages[i].vaddr, img->pages[i].paddr, PAGE_U | img->pages[i].flags);
+        }
+
+        for (int i = 0; i < img->nvmas; i++){
+            vma_add(proc, &img->vmas[i]);
+        }
+
+        if(img->end < USER_END){
+            struct vma heap = { .start = img->end, .end = USER_END, .flags = PAGE_R | PAGE_W };
+            vma_add(proc, &heap);
+        }
+
+        sp[1] = img->entry; // s0: user_entry가 sepc로 설정한다.
+        proc->image = img;
+        img->refcnt++;
+    }
+
+    proc->state = PROC_RUNNABLE;
+    rq_push(proc);
+    proc->sp = (uint32_t )sp;
+    proc->page_table = page_table;
+    proc->create_ticks = READ_CSR(time) - start_time;
+    return proc;
+}
+
+/*
+Exception의 라이프
+1. CPU는 medelg 레지스터를 확인하여 예외를 처리할 동작 모드를 결정한다. 
+OpenSBI는 이미 S-Mode의 핸들러에서 U-Mode / S-Mode 예외를 처리하도록 구성한다.
+
+2. CPU는 자신의 상태(레지스터)를 다양한 CSR에 저장한다.
+scause : 예외 유형, 커널은 이를 읽고 예외 유형을 식별한다.
+stval : 예외에 대한 추가 정보(예외를 발생시킨 메모리 주소), 예외 유형에 따라 다름
+sepc : 예외가 발생한 지점의 프로그램 카운터
+sstatus : 예외가 발생한 경우 작동 모드(u or s)
+
+3. stvec 레지스터의 값은 프로그램 카운터로 설정되어 커널의 예외 처리기로 이동한다.
+
+4. 예외 처리기는 범용 레지스터(즉, 프로그램 상태)를 저장하고 예외를 처리함
+
+5. 완료되면 예외 처리기는 저장된 실행 상태를 복원하고 sret 명령을 호출하여 예외가 발생한 지점부터 실행을 재개한다. 
+*/
+
+/*
+sscratch 레지스터는 예외 발생시 스택포인터를 저장하는 임시 저장소로 사용, 나중에 복원
+
+부동소수점 레지스터는 커널 내에서 사용되지 않으므로 여기에 저장할 필요가 없음. 일반적으로 스레드 전환 중에 저장되고 복원됨
+
+스택포인터가 a0 레지스터에 설정되고 handle_trap 함수가 호출됨. 이떄 스택포인터가 가리키는 주소에는 나중에 설명하는 trap_frame 구조와 동일한 구조에 저장된 레지스터 값이 포함됨
+
+__attribute((align(4)))을 추가하면 함수의 시작 주소가 4바이트 경계에 정렬됨
+이는 stvec 레지스터가 예외 핸들러의 주소를 보유할 뿐만 아니라 하단 2비트에 모드를 나타내는 플래그를 가지고 있음
+
+기존의 예외처리기는 실행 상태를 스택에 저장함. 
+하지만 이제 각 프로세스마다 별도의 커널 스택을 사용하기 떄문에 프로세스 전환 시 sscratch 레지스터에 현재 실행중인 프로세스의 커널 스택 초기값을 설정
+*/
+
+/*
+    csrrw 명령어
+    tmp = sp; 
+    sp = sscratch;
+    sscratch = tmp;
+
+    sp는 현재 실행 중인 프로세스의 커널(사용자 스택이 아닌) 스택을 가리킨다. 예외가 발생한 시점의 sp(사용자 스택)의 원래 값을 sscratch가 보유한다.
+    다른 레지스터를 커널 스택에 저장한 후, 원래 sp 값을 복원하고 이를 커널 스택에 저장. 그런 다음 sscratch의 초기 값을 계산하여 복원.
+    여기서 중요한 점은 프로세스가 독립적인 커널 스택을 가진다는 것. 컨텍스트 전환 중에 sscratch의 내용을 바꾸면 아무 일도 없었다는 것처럼 프로세스가 중단된 지점부터 실행을 재개할 수 있음
+*/
+
+/*
+    sscratch를 조정하여 커널 스택으로 전환해야 하는 이유
+    예외 발생 시 스택포인터를 신뢰해서는 안된다. 예외 처리기에는 다음 3가지 패턴을 고려해야딤
+    1. 커널 모드에서 예외가 발생한 경우
+    2. 커널모드에서 다른 예외(중첩 예외)를 처리할 때 예외가 발생한 경우
+    3. 사용자 모드에서 예외가 발생한 경우 
+
+    1번의 경우 스택 포인터를 재설정하지 않아도 문제 없음
+    2번의 경우 저장된 영역을 덮어쓰지만, 중첩 예외에 대한 커널 패닉을 트리거 하는 구현이므로 괜찮음
+
+    3번의 경우 sp는 사용자(어플리케이션) 스택 영역을 가리킴. sp를 그대로 사용(신뢰)하도록 구현하면 커널이 충돌하는 취약점이 발생할 수 있음
+    만약 sscratch를 조정하지 않는다면 예외 발생시 스택 포인터가 매핑되지 않은 주소(userland)를 가리키기 때문에 이에 대한 또다른 예외를 불러옴
+    -> 무한루프로 커널 중단 -> 즉, 신뢰할 수 있는 스택 영역을 처음부터 다시 가져와야 함
+*/
+__attribute__((naked))
+__attribute__((aligned(4)))
+void kernel_entry(void){
+    __asm__ __volatile__(
+        // 실행 중인 프로세스의 커널 스택을 처음부터 다시 가져온다.
+        "csrrw sp, sscratch, sp\n"
+        "addi sp, sp, -4 * 31\n"
+        "sw ra, 4 * 0(sp)\n"
+        "sw gp, 4 * 1(sp)\n"
+        "sw tp, 4 * 2(sp)\n"
+        "sw t0, 4 * 3(sp)\n"
+        "sw t1, 4 * 4(sp)\n"
+        "sw t2, 4 * 5(sp)\n"
+        "sw t3, 4 * 6(sp)\n"
+        "sw t4, 4 * 7(sp)\n"
+        "sw t5,  4 * 8(sp)\n"
+        "sw t6,  4 * 9(sp)\n"
+        "sw a0,  4 * 10(sp)\n"
+        "sw a1,  4 * 11(sp)\n"
+        "sw a2,  4 * 12(sp)\n"
+        "sw a3,  4 * 13(sp)\n"
+        "sw a4,  4 * 14(sp)\n"
         "sw a5,  4 * 15(sp)\n"
         "sw a6,  4 * 16(sp)\n"
         "sw a7,  4 * 17(sp)\n"
@@ -587,229 +2302,1200 @@ void kernel_entry(void){
         "sw s10, 4 * 28(sp)\n"
         "sw s11, 4 * 29(sp)\n"
 
-        // 예외가 발생한 시점의 SP를 검색하여 저장한다.
-        "csrr a0, sscratch\n"
-        "sw a0, 4 * 30(sp)\n"
+        // 예외가 발생한 시점의 SP를 검색하여 저장한다.
+        "csrr a0, sscratch\n"
+        "sw a0, 4 * 30(sp)\n"
+
+        // 커널스택 초기화
+        "addi a0, sp, 4 * 31\n"
+        "csrw sscratch, a0\n"
+
+        // 커널의 memcpy 등이 쓰는 벡터 유닛은 커널에서만 켠다. (t0는 이미 저장했다)
+        "li t0, %[vs]\n"
+        "csrs sstatus, t0\n"
+
+        "mv a0, sp\n"
+        "call handle_trap\n"
+
+        // fork된 자식 프로세스는 fork_ret에서 이곳으로 와서 복사된 트랩 프레임으로 U-Mode에 돌아간다.
+        "trap_return:\n"
+        // 벡터 레지스터는 문맥 교환 때 저장하지 않으므로 다른 프로세스의 데이터가 남아 있다.
+        // U-Mode에서 벡터 명령을 쓸 수 없도록 VS를 Off로 돌린다. (t0는 아래에서 복원한다)
+        "li t0, %[vs_mask]\n"
+        "csrc sstatus, t0\n"
+        "lw ra, 4 * 0(sp)\n"
+        "lw gp,  4 * 1(sp)\n"
+        "lw tp,  4 * 2(sp)\n"
+        "lw t0,  4 * 3(sp)\n"
+        "lw t1,  4 * 4(sp)\n"
+        "lw t2,  4 * 5(sp)\n"
+        "lw t3,  4 * 6(sp)\n"
+        "lw t4,  4 * 7(sp)\n"
+        "lw t5,  4 * 8(sp)\n"
+        "lw t6,  4 * 9(sp)\n"
+        "lw a0,  4 * 10(sp)\n"
+        "lw a1,  4 * 11(sp)\n"
+        "lw a2,  4 * 12(sp)\n"
+        "lw a3,  4 * 13(sp)\n"
+        "lw a4,  4 * 14(sp)\n"
+        "lw a5,  4 * 15(sp)\n"
+        "lw a6,  4 * 16(sp)\n"
+        "lw a7,  4 * 17(sp)\n"
+        "lw s0,  4 * 18(sp)\n"
+        "lw s1,  4 * 19(sp)\n"
+        "lw s2,  4 * 20(sp)\n"
+        "lw s3,  4 * 21(sp)\n"
+        "lw s4,  4 * 22(sp)\n"
+        "lw s5,  4 * 23(sp)\n"
+        "lw s6,  4 * 24(sp)\n"
+        "lw s7,  4 * 25(sp)\n"
+        "lw s8,  4 * 26(sp)\n"
+        "lw s9,  4 * 27(sp)\n"
+        "lw s10, 4 * 28(sp)\n"
+        "lw s11, 4 * 29(sp)\n"
+        "lw sp,  4 * 30(sp)\n"
+        "sret\n"
+        :
+        : [vs] "i" (SSTATUS_VS),
+          [vs_mask] "i" (SSTATUS_VS_MASK)
+    );
+}
+
+/*
+    트랩 핸들러에 저장된 "registers at the time of exception"의 구조를 받는다.
+*/
+void handle_syscall(struct trap_frame *f){
+    switch(f->a3){
+        case SYS_READFILE:
+        case SYS_WRITEFILE: {
+            /*
+                사용자가 임의의 메모리 영역을 지정해서 커널 메모리 영역을 읽고 쓰지 못하도록
+                파일 이름은 커널 버퍼로 복사하고, buf는 사용자 페이지인지(읽기면 쓰기 권한까지) 확인한다.
+            */
+            char filename[FILE_NAME_MAX];
+            char *buf = (char *)f->a1;
+            int len = f->a2;
+            if(user_copy_str(current_proc, filename, f->a0, sizeof(filename)) < 0
+               || (len > 0 && !user_check(current_proc, (vaddr_t) buf, len, f->a3 == SYS_READFILE))){
+                f->a0 = -1;
+                break;
+            }
+
+            fs_lock();
+            struct file *file = fs_lookup(filename);
+            if(!file && f->a3 == SYS_WRITEFILE){
+                file = fs_create(filename);
+            }
+
+            if(!file) {
+                fs_unlock();
+                printf("file not found: %s\n", filename);
+                f->a0 = -1;
+                break;
+            }
+
+            if(f->a3 == SYS_WRITEFILE){
+                if(len < 0 || !fs_fits(file, len)){
+                    fs_unlock();
+                    printf("no space left on disk: %s\n", filename);
+                    f->a0 = -1;
+                    break;
+                }
+
+                // 파일 전체를 덮어쓰므로 기존 내용은 읽지 않는다.
+                file->loaded = true;
+                fs_resize(file, 0);
+                f->a0 = fs_write(file, 0, buf, len);
+                if(fs_flush() < 0){
+                    f->a0 = -1;
+                }
+            } else if(len < 0){
+                f->a0 = -1;
+            } else {
+                f->a0 = fs_read(file, 0, buf, len);
+            }
+
+            fs_unlock();
+            break;
+        }
+        case SYS_EXIT:
+            printf("process %d exited\n", current_proc->pid);
+            /*
+                페이지 테이블과 사용자 페이지를 반환하고 PROC_EXITED로 표시한다.
+                종료된 프로세스의 슬롯은 create_process에서 재사용된다.
+            */
+            release_process(current_proc);
+            current_proc->state = PROC_EXITED;
+            proc_wakeup(current_proc); // SYS_WAIT으로 기다리는 프로세스를 깨운다.
+            yield();
+            PANIC("unreachable");
+        // 입력된 줄에서 한 글자를 읽는다. 완성된 줄이 없으면 잠든다.
+        case SYS_GETCHAR: {
+            char ch;
+            console_read(&ch, 1);
+            f->a0 = (uint8_t) ch;
+            break;
+        }
+
+        case SYS_PUTCHAR:
+            putchar(f->a0);
+            break;
+
+        // a0 버퍼에 최대 a1 - 1 바이트의 한 줄을 읽는다. (시스템 콜 한 번으로 줄 편집이 끝난 입력을 받는다)
+        case SYS_READLINE: {
+            char *buf = (char *) f->a0;
+            int len = f->a1;
+            if(len <= 0){
+                f->a0 = -1;
+                break;
+            }
+
+            if(!user_check(current_proc, (vaddr_t) buf, len, true)){
+                f->a0 = -1;
+                break;
+            }
+
+            f->a0 = tty_readline(buf, len);
+            break;
+        }
+
+        /*
+            a0의 pid(0이면 자기 자신)를 가진 프로세스의 우선순위를 a1로 바꾼다. 0이 가장 높은 우선순위이다.
+            우선순위가 더 높은 프로세스가 생겼을 수 있으므로 바로 yield한다.
+        */
+        case SYS_SETPRIO: {
+            int pid = f->a0;
+            int priority = f->a1;
+            struct process *proc = pid == 0 ? current_proc : proc_lookup(pid);
+            if(!proc || priority < 0 || priority >= PRIO_LEVELS){
+                f->a0 = -1;
+                break;
+            }
+
+            set_priority(proc, priority);
+            f->a0 = 0;
+            yield();
+            break;
+        }
+
+        /*
+            a0의 pid(0이면 자기 자신)를 가진 프로세스의 시간 조각을 a1 밀리초로 바꾼다.
+            새 값은 그 프로세스가 다음에 실행될 때(timer_arm)부터 적용된다.
+        */
+        case SYS_SETSLICE: {
+            int pid = f->a0;
+            int ms = f->a1;
+            struct process *proc = pid == 0 ? current_proc : proc_lookup(pid);
+            if(!proc || ms <= 0 || ms > TIME_SLICE_MAX_MS){
+                f->a0 = -1;
+                break;
+            }
+
+            proc->time_slice = ms * TIMER_TICKS_PER_MS;
+            f->a0 = 0;
+            break;
+        }
+
+        // a0 이름의 파일을 삭제하고 디스크에 반영한다.
+        case SYS_UNLINK: {
+            char path[FILE_NAME_MAX];
+            if(user_copy_str(current_proc, path, f->a0, sizeof(path)) < 0){
+                f->a0 = -1;
+                break;
+            }
+
+            fs_lock();
+            struct file *file = fs_lookup(path);
+            if(!file || file->nopen || fs_delete(file) < 0){
+                fs_unlock();
+                f->a0 = -1;
+                break;
+            }
+
+            f->a0 = fs_flush();
+            fs_unlock();
+            break;
+        }
+
+        /*
+            파일 디스크립터 시스템 콜
+            open은 이름으로 한 번만 파일을 찾고, 이후 read/write/lseek은 디스크립터의 오프셋을 기준으로 동작한다.
+            write 내용은 버퍼 캐시에만 반영해 두었다가 마지막 디스크립터를 닫을 때 fs_flush로 디스크에 기록한다.
+        */
+        case SYS_OPEN: {
+            char filename[FILE_NAME_MAX];
+            int flags = f->a1;
+            if(user_copy_str(current_proc, filename, f->a0, sizeof(filename)) < 0){
+                f->a0 = -1;
+                break;
+            }
+
+            fs_lock();
+            struct file *file = fs_lookup(filename);
+            if(!file && (flags & O_CREAT)){
+                file = fs_create(filename);
+            }
+
+            struct open_file *of = NULL;
+            for (int i = 0; i < OPEN_FILES_MAX; i++){
+                if(open_files[i].refcnt == 0){
+                    of = &open_files[i];
+                    break;
+                }
+            }
+
+            int fd = file && of ? fd_alloc(current_proc, of) : -1;
+            if(fd < 0){
+                fs_unlock();
+                f->a0 = -1;
+                break;
+            }
+
+            of->refcnt = 1;
+            of->file = file;
+            of->offset = 0;
+            of->flags = flags;
+            file->nopen++;
+            if((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY){
+                file->loaded = true;
+                fs_resize(file, 0);
+            }
+
+            fs_unlock();
+            f->a0 = fd;
+            break;
+        }
+
+        case SYS_CLOSE: {
+            int fd = f->a0;
+            struct open_file *of = fd_get(current_proc, fd);
+            if(!of){
+                f->a0 = -1;
+                break;
+            }
+
+            current_proc->fds[fd] = NULL;
+            f->a0 = file_close(of);
+            break;
+        }
+
+        case SYS_READ:
+        case SYS_WRITE: {
+            struct open_file *of = fd_get(current_proc, f->a0);
+            void *buf = (void *) f->a1;
+            int len = f->a2;
+            if(f->a0 == FD_STDIN || f->a0 == FD_STDOUT || f->a0 == FD_STDERR){
+                // 콘솔: 한 번의 시스템 콜로 버퍼 전체를 읽거나 쓴다.
+                if(len < 0 || (f->a3 == SYS_READ) != (f->a0 == FD_STDIN)
+                   || !user_check(current_proc, (vaddr_t) buf, len, f->a3 == SYS_READ)){
+                    f->a0 = -1;
+                    break;
+                }
+
+                f->a0 = f->a3 == SYS_READ ? console_read(buf, len) : console_write(buf, len);
+                break;
+            }
+
+            int mode = of ? of->flags & O_ACCMODE : 0;
+            if(!of || len < 0 || (f->a3 == SYS_READ && mode == O_WRONLY) || (f->a3 == SYS_WRITE && mode == O_RDONLY)
+               || !user_check(current_proc, (vaddr_t) buf, len, f->a3 == SYS_READ)){
+                f->a0 = -1;
+                break;
+            }
+
+            fs_lock();
+            if(f->a3 == SYS_READ){
+                len = fs_read(of->file, of->offset, buf, len);
+            } else if(of->offset + len > of->file->size && !fs_fits(of->file, of->offset + len)){
+                len = -1;
+            } else {
+                len = fs_write(of->file, of->offset, buf, len);
+            }
+            fs_unlock();
+
+            if(len < 0){
+                f->a0 = -1;
+                break;
+            }
+
+            of->offset += len;
+            f->a0 = len;
+            break;
+        }
+
+        case SYS_LSEEK: {
+            struct open_file *of = fd_get(current_proc, f->a0);
+            int off = f->a1;
+            int whence = f->a2;
+            int base = -1;
+            if(of){
+                base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? (int) of->offset : whence == SEEK_END ? (int) of->file->size : -1;
+            }
+
+            if(base < 0 || base + off < 0){
+                f->a0 = -1;
+                break;
+            }
+
+            of->offset = base + off;
+            f->a0 = of->offset;
+            break;
+        }
+
+        /*
+            a0 디스크립터가 가리키는 파일의 a1 오프셋부터 a2 바이트를 사용자 공간에 매핑하고 시작 주소를 반환한다.
+            파일 캐시 페이지를 그대로 매핑하므로 커널에서 사용자 버퍼로의 복사가 없다.
+            a4(prot)에 PROT_WRITE가 있으면 private 매핑으로, 처음 쓸 때 handle_page_fault가 페이지를 복사한다.
+        */
+        case SYS_MMAP: {
+            struct open_file *of = fd_get(current_proc, f->a0);
+            uint32_t offset = f->a1;
+            uint32_t len = f->a2;
+            int prot = f->a4;
+            if(!of || (of->flags & O_ACCMODE) == O_WRONLY || !is_aligned(offset, PAGE_SIZE) || len == 0
+               || align_up(len, PAGE_SIZE) == 0 || (prot & ~(PROT_READ | PROT_WRITE))
+               || align_up(len, PAGE_SIZE) > MMAP_END - current_proc->mmap_next){
+                f->a0 = -1;
+                break;
+            }
+
+            // 32비트 덧셈이 넘치지 않도록 뺄셈으로 비교한다.
+            struct file *file = of->file;
+            fs_lock();
+            uint32_t file_end = align_up(file->size, PAGE_SIZE);
+            if(offset > file_end || len > file_end - offset || fs_load(file) < 0){
+                fs_unlock();
+                f->a0 = -1;
+                break;
+            }
+
+            vaddr_t vaddr = current_proc->mmap_next;
+            uint32_t flags = PAGE_U | PAGE_R | (prot & PROT_WRITE ? PAGE_COW : 0);
+            for (uint32_t off = 0; off < len; off += PAGE_SIZE){
+                paddr_t page = file->pages[(offset + off) / PAGE_SIZE];
+                page_get(page);
+                map_page(current_proc->page_table, vaddr + off, page, flags);
+                tlb_flush_page(current_proc, vaddr + off);
+            }
+
+            fs_unlock();
+            current_proc->mmap_next += align_up(len, PAGE_SIZE);
+            f->a0 = vaddr;
+            break;
+        }
+
+        /*
+            a0 주소부터 a1 바이트의 mmap 매핑을 해제하고 파일 페이지(또는 복사본)의 참조를 놓는다.
+            매핑 영역의 끝에서부터 비게 되면 mmap_next를 되돌려 가상 주소를 다시 사용한다.
+        */
+        case SYS_MUNMAP: {
+            vaddr_t addr = f->a0;
+            uint32_t len = f->a1;
+            if(!is_aligned(addr, PAGE_SIZE) || len == 0 || align_up(len, PAGE_SIZE) == 0 || addr < MMAP_BASE || addr > current_proc->mmap_next
+               || align_up(len, PAGE_SIZE) > current_proc->mmap_next - addr){
+                f->a0 = -1;
+                break;
+            }
+
+            for (vaddr_t va = addr; va < addr + align_up(len, PAGE_SIZE); va += PAGE_SIZE){
+                uint32_t *pte = walk_pte(current_proc->page_table, va);
+                if(pte && (*pte & PAGE_V)){
+                    page_put((*pte >> 10) * PAGE_SIZE);
+                    *pte = 0;
+                    tlb_flush_page(current_proc, va);
+                }
+            }
+
+            while(current_proc->mmap_next > MMAP_BASE){
+                uint32_t *pte = walk_pte(current_proc->page_table, current_proc->mmap_next - PAGE_SIZE);
+                if(pte && (*pte & PAGE_V)){
+                    break;
+                }
+                current_proc->mmap_next -= PAGE_SIZE;
+            }
+
+            f->a0 = 0;
+            break;
+        }
+
+        // 현재 프로세스를 복제한다. 부모에게는 자식의 pid, 자식에게는 0을 반환한다.
+        case SYS_FORK: {
+            struct process *child = fork(f);
+            f->a0 = child ? child->pid : -1;
+            break;
+        }
+
+        // a0 경로의 프로그램을 a1 인자(argv)로 실행하는 새 프로세스를 만들고 pid를 반환한다.
+        case SYS_SPAWN: {
+            char path[FILE_NAME_MAX];
+            struct process *proc = NULL;
+            if(user_copy_str(current_proc, path, f->a0, sizeof(path)) >= 0){
+                proc = spawn(path, (char **) f->a1);
+            }
+            f->a0 = proc ? proc->pid : -1;
+            break;
+        }
+
+        /*
+            a0 pid의 프로세스가 종료될 때까지 기다린다. 이미 종료되었으면 바로 반환한다.
+            슬롯이 다른 프로세스에 재사용되면 pid가 달라지므로 기다리기를 멈춘다.
+        */
+        case SYS_WAIT: {
+            int pid = f->a0;
+            if(pid <= 0 || pid == current_proc->pid){
+                f->a0 = -1;
+                break;
+            }
+
+            struct process *proc = proc_lookup(pid);
+            while(proc && proc->pid == pid && proc->state != PROC_UNUSED && proc->state != PROC_EXITED){
+                proc_sleep(proc);
+            }
+
+            f->a0 = 0;
+            break;
+        }
+
+        // 커널 내부 통계를 콘솔에 출력한다. a0에 출력할 항목(KSTAT_*)을 지정
+        case SYS_KSTAT: {
+            int which = f->a0;
+            f->a0 = 0;
+            switch(which){
+                case KSTAT_PAGES:
+                    dump_page_stats();
+                    break;
+                case KSTAT_PROCS:
+                    dump_procs();
+                    break;
+                case KSTAT_BCACHE:
+                    dump_bcache_stats();
+                    break;
+                case KSTAT_MEMBENCH:
+                    dump_membench();
+                    break;
+                default:
+                    f->a0 = -1;
+            }
+            break;
+        }
+        default:
+            PANIC("unexpected syscall a3=%x\n", f->a3);
+    }
+}
+
+struct file *fs_lookup(const char *filename) {
+    unsigned i = fs_hash(filename) & (fs_index_cap - 1);
+    while(fs_index[i]){
+        if(fs_index[i] != FS_INDEX_DELETED && !strcmp(fs_index[i]->name, filename)){
+            return fs_index[i];
+        }
+        i = (i + 1) & (fs_index_cap - 1);
+    }
+
+    return NULL;
+}
+
+
+// sret:: 트랩 핸들러에서 반환(프로그램 카운터, 작동 모드 등 복원)
+/*
+https://github.com/d0iasm/rvemu/blob/f55eb5b376f22a73c0cf2630848c03f8d5c93922/src/cpu.rs#L3357-L3400
+The RISC-V Reader 참조
+Supervisor-Mode Exception handler에서 Return한다. 
+PC(Program Counter)를 CSRs(sepc)에 저장하고 privilege mode를 CSRs[sstatus].SPP, 
+CSRs(sstatus).SIE를 CSRs[sstatus].SPIE에 저장, CSR[sstatus].SPIE를 1로 세팅 그리고 CSPs[sstatus].SPP를 0으로 세팅
+QEMU에서는 mstatus를 sstatus대신 사용
+*/
+
+
+void handle_trap(struct trap_frame *f){
+    uint32_t scause = READ_CSR(scause);
+    uint32_t stval = READ_CSR(stval);
+    uint32_t user_pc = READ_CSR(sepc);
+
+    /*
+        ecall 명령어가 호출되었는지 여부는 scause 값을 확인하여 확인이 가능하다.
+        handle_syscall 함수를 호출하는 것 이외에도 sepc값에 4(ecall 명령어의 크기)를 더한다.
+        이는 sepc가 예외를 발생시킨 프로그램 카운터를 가리키며 이 카운터가 ecall 명령어를 가리키기 때문이다. 
+        이를 변경하지 않으면 커널이 같은 위치로 돌아가서 ecall 명령어가 반복적으로 실행된다.
+    */
+    if (scause == SCAUSE_ECALL){
+        handle_syscall(f);
+        user_pc += 4;
+    } else if (scause == (SCAUSE_INTERRUPT | IRQ_S_EXTERNAL)){
+        // 장치 인터럽트 (PLIC)
+        handle_external_irq();
+    } else if (scause == (SCAUSE_INTERRUPT | IRQ_S_TIMER)){
+        /*
+            타이머 인터럽트: 현재 프로세스의 time slice가 끝났으므로 다른 프로세스에 CPU를 넘긴다.
+            실행 가능한 다른 프로세스가 없으면 yield가 바로 반환되므로 먼저 다음 time slice를 설정해 둔다.
+            인터럽트는 U-Mode에서만 받으므로(S-Mode에서는 sstatus.SIE가 0) 커널 코드 실행 중에 선점되는 일은 없다.
+        */
+        current_proc->nr_preempts++;
+        timer_arm(current_proc);
+        yield();
+    } else if ((scause == SCAUSE_INST_PAGE_FAULT || scause == SCAUSE_LOAD_PAGE_FAULT || scause == SCAUSE_STORE_PAGE_FAULT)
+               && handle_page_fault(current_proc, scause, stval)){
+        // 페이지를 매핑(또는 복사)했다. sepc를 그대로 두어 같은 명령어를 다시 실행한다.
+    } else {
+        /*
+            scause가 2이면 프로그램이 잘못된 명령어를 실행하려고 시도했음을 의미 unimp의 예상동작
+            sepc의 값은 unimp 명령어가 호출되는 줄을 가리킴
+        */
+        PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval, user_pc);
+    }
+
+    WRITE_CSR(sepc, user_pc);
+}
+
+/*
+프로그램이 메모리에 접근할 때 CPU는 지정된 주소(가상 주소)를 실제 주소로 변환한다.
+가상 주소를 물리적 주소에 매핑하는 테이블을 페이지 테이블이라고 함.
+페이지 테이블을 전환하면 동일한 가상 주소가 다른 물리적 주소를 가리킬 수 있음 
+이를 통해 메모리 공간(가상 주소 공간)을 격리하고 커널과 애플리케이션 메모리 영역을 분리하여 시스템보안 강화
+
+2단계 페이지 테이블 사용하는 RISC-V의 페이징 메커니즘인 Sv32
+32비트 가상 주소는 1단계 페이지 테이블 인덱스(VPN[1]과 2단계 인덱스 VPN[0]으로 나눠진다.
+
+동일한 4KB 페이지 내의 주소는 동일한 페이지 테이블 항목에 있음
+메모리에 접근할 때 CPU는 VPN[1], VPN[0]을 계산하여 상응하는 페이지테이블의 엔트리를 찾고 읽어서 매핑된 물리주소를 읽음
+그리고 offset을 더해서 물리주소를 얻음 
+*/
+
+/*
+링커 스크립트의 ALIGN(4096)으로 인해 __free_ram은 4KB 경계에 배치됨.
+따라서 alloc_pages 함수는 항상 4KB에 정렬된 주솔르 반환한다. __free_ram_end를 초과해서 할당을 시도하면, 메모리 부족으로 커널 패닉 발생
+
+메모리 해제를 위해 비트맵 기반 알고리즘을 사용한다.
+__free_ram ~ __free_ram_end의 각 페이지마다 1비트를 두고 1이면 사용 중, 0이면 비어 있는 페이지이다. (64MB -> 16384비트 = 2KB)
+free_hint는 마지막으로 할당한 영역의 끝 또는 가장 최근에 해제된 위치를 기억하는 캐시(free-run cache)이다.
+대부분의 할당은 비트맵 처음부터 훑지 않고 힌트 위치에서 바로 빈 페이지를 찾는다. 모두 사용 중인 32비트 워드는 한 번에 건너뛴다.
+ */
+uint32_t page_bitmap[FREE_RAM_PAGES / 32];
+/*
+    페이지 프레임별 참조 수. alloc_pages가 1로, free_pages가 0으로 만든다.
+    여러 곳(파일 캐시, 여러 프로세스의 페이지 테이블)에서 공유하는 단일 페이지는 page_get/page_put으로 관리하고 마지막 참조가 사라질 때 반환한다.
+*/
+uint16_t page_refs[FREE_RAM_PAGES];
+unsigned free_hint;
+struct page_stats page_stats;
+/*
+    미리 0으로 채운 빈 페이지 풀 (인덱스 스택)
+    alloc_pages는 페이지를 0으로 채워 반환하므로 프로세스 생성, 페이지 테이블 할당, 페이지 폴트 처리마다 memset 비용이 든다.
+    유휴 프로세스가 실행할 프로세스가 없을 때 빈 페이지를 0으로 채워 두고(zero_pool_fill), 1페이지 할당은 여기서 꺼내 쓴다.
+    풀의 페이지는 다른 할당이 가져가지 않도록 비트맵에서는 사용 중으로 표시하지만 page_stats.used에는 세지 않는다. (빈 페이지)
+*/
+unsigned zero_pool[ZERO_POOL_MAX];
+unsigned zero_pool_len;
+
+bool page_is_used(unsigned idx){
+    return (page_bitmap[idx / 32] >> (idx % 32)) & 1;
+}
+
+void page_set_used(unsigned idx, bool used){
+    if(used){
+        page_bitmap[idx / 32] |= 1u << (idx % 32);
+    } else {
+        page_bitmap[idx / 32] &= ~(1u << (idx % 32));
+    }
+}
+
+// [from, to) 범위에서 연속된 n개의 빈 페이지를 찾아 첫 번째 페이지의 인덱스를 반환한다. 없으면 -1
+int find_free_run(unsigned from, unsigned to, uint32_t n){
+    unsigned run = 0;
+    for (unsigned idx = from; idx < to; idx++){
+        if(idx % 32 == 0 && idx + 32 <= to && page_bitmap[idx / 32] == 0xffffffff){
+            run = 0;
+            idx += 31;
+            continue;
+        }
+
+        if(page_is_used(idx)){
+            run = 0;
+            continue;
+        }
+
+        if(++run == n){
+            return idx + 1 - n;
+        }
+    }
+
+    return -1;
+}
+
+paddr_t alloc_pages(uint32_t n){
+    unsigned total = ((paddr_t) __free_ram_end - (paddr_t) __free_ram) / PAGE_SIZE;
+    if(total > FREE_RAM_PAGES){
+        PANIC("free ram is larger than FREE_RAM_SIZE");
+    }
+
+    if(n == 1 && zero_pool_len > 0){
+        unsigned idx = zero_pool[--zero_pool_len];
+        page_refs[idx] = 1;
+        page_stats.allocs++;
+        page_stats.zero_hits++;
+        page_stats.used++;
+        if(page_stats.used > page_stats.peak){
+            page_stats.peak = page_stats.used;
+        }
+        return (paddr_t) __free_ram + idx * PAGE_SIZE;
+    }
+
+    int idx = find_free_run(free_hint, total, n);
+    if(idx < 0){
+        idx = find_free_run(0, total, n);
+    }
+
+    // 풀이 잡고 있는 페이지 때문에 연속된 영역을 찾지 못했을 수 있으므로 풀을 비우고 다시 찾는다.
+    if(idx < 0 && zero_pool_len > 0){
+        zero_pool_drain();
+        idx = find_free_run(0, total, n);
+    }
+
+    if(idx < 0){
+        PANIC("out of memory");
+    }
+
+    if(n == 1){
+        page_stats.zero_misses++;
+    }
+
+    for (unsigned i = 0; i < n; i++){
+        page_set_used(idx + i, true);
+        page_refs[idx + i] = 1;
+    }
+    free_hint = idx + n;
+
+    page_stats.allocs++;
+    page_stats.used += n;
+    if(page_stats.used > page_stats.peak){
+        page_stats.peak = page_stats.used;
+    }
+
+    paddr_t paddr = (paddr_t) __free_ram + idx * PAGE_SIZE;
+    memset((void *)paddr, 0, n * PAGE_SIZE);
+    return paddr;
+}
+
+// alloc_pages로 할당한 n개의 페이지를 반환한다.
+void free_pages(paddr_t paddr, uint32_t n){
+    if(!is_aligned(paddr, PAGE_SIZE) || paddr < (paddr_t) __free_ram || paddr + n * PAGE_SIZE > (paddr_t) __free_ram_end){
+        PANIC("free_pages: invalid paddr %x", paddr);
+    }
+
+    unsigned idx = (paddr - (paddr_t) __free_ram) / PAGE_SIZE;
+    for (unsigned i = 0; i < n; i++){
+        if(!page_is_used(idx + i)){
+            PANIC("free_pages: double free paddr=%x", paddr + i * PAGE_SIZE);
+        }
+        page_set_used(idx + i, false);
+        page_refs[idx + i] = 0;
+    }
+
+    if(idx < free_hint){
+        free_hint = idx;
+    }
+
+    page_stats.frees++;
+    page_stats.used -= n;
+}
+
+void page_get(paddr_t paddr){
+    unsigned idx = (paddr - (paddr_t) __free_ram) / PAGE_SIZE;
+    if(!page_is_used(idx)){
+        PANIC("page_get: free page paddr=%x", paddr);
+    }
+    page_refs[idx]++;
+}
+
+void page_put(paddr_t paddr){
+    unsigned idx = (paddr - (paddr_t) __free_ram) / PAGE_SIZE;
+    if(--page_refs[idx] == 0){
+        page_refs[idx] = 1;
+        free_pages(paddr, 1);
+    }
+}
+
+unsigned page_refcount(paddr_t paddr){
+    return page_refs[(paddr - (paddr_t) __free_ram) / PAGE_SIZE];
+}
+
+/*
+    빈 페이지 하나를 0으로 채워 풀에 넣는다. (유휴 프로세스)
+    풀이 가득 찼거나 빈 페이지가 없으면 false를 반환한다.
+*/
+bool zero_pool_fill(void){
+    if(zero_pool_len == ZERO_POOL_MAX){
+        return false;
+    }
+
+    unsigned total = ((paddr_t) __free_ram_end - (paddr_t) __free_ram) / PAGE_SIZE;
+    int idx = find_free_run(free_hint, total, 1);
+    if(idx < 0){
+        idx = find_free_run(0, total, 1);
+    }
+
+    if(idx < 0){
+        return false;
+    }
+
+    page_set_used(idx, true);
+    memset((void *) ((paddr_t) __free_ram + idx * PAGE_SIZE), 0, PAGE_SIZE);
+    zero_pool[zero_pool_len++] = idx;
+    return true;
+}
+
+// 풀의 페이지를 모두 빈 페이지로 되돌린다.
+void zero_pool_drain(void){
+    while(zero_pool_len > 0){
+        unsigned idx = zero_pool[--zero_pool_len];
+        page_set_used(idx, false);
+        if(idx < free_hint){
+            free_hint = idx;
+        }
+    }
+}
+
+unsigned free_page_count(void){
+    unsigned total = ((paddr_t) __free_ram_end - (paddr_t) __free_ram) / PAGE_SIZE;
+    return total - page_stats.used;
+}
+
+/*
+    할당 상태와 단편화 정도를 출력한다.
+    free_runs는 연속된 빈 영역의 개수, largest_run은 가장 긴 빈 영역(페이지 수)이다.
+    frag는 빈 페이지 중 가장 긴 빈 영역에 속하지 않는 비율로, 0%면 빈 공간이 하나로 모여 있다는 뜻이다.
+*/
+void dump_page_stats(void){
+    unsigned total = ((paddr_t) __free_ram_end - (paddr_t) __free_ram) / PAGE_SIZE;
+    unsigned free_runs = 0, largest_run = 0, run = 0;
+    for (unsigned idx = 0; idx <= total; idx++){
+        if(idx < total && !page_is_used(idx)){
+            run++;
+            continue;
+        }
+
+        if(run > 0){
+            free_runs++;
+            if(run > largest_run){
+                largest_run = run;
+            }
+        }
+        run = 0;
+    }
+
+    unsigned free = total - page_stats.used;
+    printf("pages: total=%d used=%d free=%d peak=%d\n", total, page_stats.used, free, page_stats.peak);
+    printf("pages: allocs=%d frees=%d free_runs=%d largest_run=%d frag=%d%%\n",
+           page_stats.allocs, page_stats.frees, free_runs, largest_run,
+           free ? 100 - largest_run * 100 / free : 0);
+    printf("pages: zero_pool=%d zero_hits=%d zero_misses=%d\n", zero_pool_len, page_stats.zero_hits, page_stats.zero_misses);
+}
+
+/*
+1단계 페이지 테이블(table1), 가상 주소(vaddr), 물리 주소(paddr), 페이지 테이블 항목 플래그를 받음
+두 번째 수준의 페이지 테이블을 준비하고 두 번째 수준의 페이지 테이블 항목을 채운다.
+항목에 실제 주소 자체가 아니라 실제 페이지 번호가 포함되어야 하므로 paddr을 PAGE_SIZE로 나눈다. 
+ */
+void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags){
+    if(!is_aligned(vaddr, PAGE_SIZE)) {
+        PANIC("unaligned vaddr %x", vaddr);
+    }
+
+    if(!is_aligned(paddr, PAGE_SIZE)) {
+        PANIC("unaligned paddr: %x", paddr);
+    }
+
+    uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    if (table1[vpn1] & (PAGE_R | PAGE_W | PAGE_X)){
+        PANIC("vaddr %x is already mapped by a megapage", vaddr);
+    }
+
+    if ((table1[vpn1] & PAGE_V) == 0){
+        // Create the non-existent 2nd level page table
+        uint32_t pt_paddr = alloc_pages(1);
+        table1[vpn1] = ((pt_paddr / PAGE_SIZE) << 10) | PAGE_V; 
+    }
+
+    // set the 2nd level page table entry to map the physical page.
+    uint32_t vpn0 = (vaddr >> 12) & 0x3ff;
+    uint32_t *table0 = (uint32_t *)((table1[vpn1] >> 10) * PAGE_SIZE);
+    table0[vpn0] = ((paddr / PAGE_SIZE) << 10 | flags | PAGE_V);
+}
+
+// vaddr를 매핑하는 2단계 페이지 테이블 항목의 주소를 반환한다. 2단계 테이블이 없으면 NULL
+uint32_t *walk_pte(uint32_t *table1, vaddr_t vaddr){
+    uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    if((table1[vpn1] & PAGE_V) == 0 || (table1[vpn1] & (PAGE_R | PAGE_W | PAGE_X))){
+        return NULL;
+    }
+
+    uint32_t *table0 = (uint32_t *)((table1[vpn1] >> 10) * PAGE_SIZE);
+    return &table0[(vaddr >> 12) & 0x3ff];
+}
+
+/*
+    PAGE_COW 페이지를 복사해서 쓰기 가능하게 매핑한다.
+    다른 참조가 없으면 복사하지 않고 그 페이지에 쓰기 권한만 준다.
+    vaddr가 copy-on-write 페이지가 아니면 false를 반환한다.
+*/
+bool cow_fault(struct process *proc, vaddr_t vaddr){
+    uint32_t *pte = walk_pte(proc->page_table, vaddr);
+    if(!pte || (*pte & (PAGE_V | PAGE_U | PAGE_COW)) != (PAGE_V | PAGE_U | PAGE_COW)){
+        return false;
+    }
+
+    paddr_t old = (*pte >> 10) * PAGE_SIZE;
+    uint32_t flags = (*pte & 0x3ff & ~PAGE_COW) | PAGE_W;
+    if(page_refcount(old) == 1){
+        *pte = (old / PAGE_SIZE) << 10 | flags;
+    } else {
+        paddr_t page = alloc_pages(1);
+        memcpy((void *) page, (void *) old, PAGE_SIZE);
+        *pte = (page / PAGE_SIZE) << 10 | flags;
+        page_put(old);
+    }
+
+    tlb_flush_page(proc, vaddr & ~(PAGE_SIZE - 1));
+    return true;
+}
+
+// proc의 VMA 중 vaddr를 포함하는 것을 찾는다.
+struct vma *vma_find(struct process *proc, vaddr_t vaddr){
+    for (int i = 0; i < proc->nvmas; i++){
+        if(proc->vmas[i].start <= vaddr && vaddr < proc->vmas[i].end){
+            return &proc->vmas[i];
+        }
+    }
+
+    return NULL;
+}
+
+void vma_add(struct process *proc, const struct vma *vma){
+    if(proc->nvmas == VMA_MAX){
+        PANIC("too many vmas");
+    }
+
+    proc->vmas[proc->nvmas++] = *vma;
+}
+
+/*
+    Page fault(scause 12, 13, 15)를 처리한다.
+    - copy-on-write 페이지에 쓰려고 했다면 cow_fault가 복사한다.
+    - 아직 매핑되지 않은 주소라면 그 주소를 포함하는 VMA를 찾아 처음 접근한 페이지만 할당해서 매핑한다.
+      실행 이미지 영역은 이미지에서 복사하고, bss/스택 영역은 0으로 채운 페이지를 그대로 쓴다. 접근하지 않은 페이지는 할당되지 않는다.
+    VMA 밖이거나 권한이 맞지 않으면 false를 반환한다.
+*/
+bool handle_page_fault(struct process *proc, uint32_t scause, vaddr_t vaddr){
+    uint32_t *pte = walk_pte(proc->page_table, vaddr);
+    if(pte && (*pte & PAGE_V)){
+        return scause == SCAUSE_STORE_PAGE_FAULT && cow_fault(proc, vaddr);
+    }
+
+    struct vma *vma = vma_find(proc, vaddr);
+    uint32_t need = scause == SCAUSE_INST_PAGE_FAULT ? PAGE_X : scause == SCAUSE_LOAD_PAGE_FAULT ? PAGE_R : PAGE_W;
+    if(!vma || !(vma->flags & need)){
+        return false;
+    }
+
+    vaddr_t va = vaddr & ~(PAGE_SIZE - 1);
+    paddr_t page = alloc_pages(1);
+    if(vma->src){
+        // [src_vaddr, src_vaddr + src_size) 중 이 페이지에 걸치는 부분만 복사한다.
+        vaddr_t copy_start = va > vma->src_vaddr ? va : vma->src_vaddr;
+        vaddr_t copy_end = va + PAGE_SIZE < vma->src_vaddr + vma->src_size ? va + PAGE_SIZE : vma->src_vaddr + vma->src_size;
+        if(copy_start < copy_end){
+            memcpy((void *) (page + copy_start - va), (const uint8_t *) vma->src + (copy_start - vma->src_vaddr), copy_end - copy_start);
+        }
+    }
+
+    map_page(proc->page_table, va, page, vma->flags | PAGE_U);
+    tlb_flush_page(proc, va);
+    return true;
+}
+
+/*
+    커널이 시스템 콜에서 사용자 버퍼에 접근하기 전에 호출한다.
+    커널 모드에서는 page fault를 처리하지 않으므로 [vaddr, vaddr + len) 범위에서 아직 매핑되지 않은 페이지를 미리 매핑하고,
+    write이면 copy-on-write 페이지도 미리 복사해 둔다. VMA 밖의 주소는 그대로 둔다.
+*/
+void user_prepare(struct process *proc, vaddr_t vaddr, size_t len, bool write){
+    if(len == 0){
+        return;
+    }
+
+    for (vaddr_t va = vaddr & ~(PAGE_SIZE - 1); va < vaddr + len; va += PAGE_SIZE){
+        handle_page_fault(proc, write ? SCAUSE_STORE_PAGE_FAULT : SCAUSE_LOAD_PAGE_FAULT, va);
+    }
+}
 
-        // 커널스택 초기화
-        "addi a0, sp, 4 * 31\n"
-        "csrw sscratch, a0\n"
+/*
+    user_prepare 후 [vaddr, vaddr + len)의 모든 페이지가 사용자 페이지로 매핑되었는지 확인한다.
+    커널은 S-Mode의 page fault를 처리하지 않으므로 검사하지 않은 사용자 포인터를 따라가면 커널이 멈춘다.
+*/
+bool user_check(struct process *proc, vaddr_t vaddr, size_t len, bool write){
+    if(len == 0){
+        return true;
+    }
 
-        "mv a0, sp\n"
-        "call handle_trap\n"
+    if(vaddr + len < vaddr){
+        return false;
+    }
 
-        "lw ra, 4 * 0(sp)\n"
-        "lw gp,  4 * 1(sp)\n"
-        "lw tp,  4 * 2(sp)\n"
-        "lw t0,  4 * 3(sp)\n"
-        "lw t1,  4 * 4(sp)\n"
-        "lw t2,  4 * 5(sp)\n"
-        "lw t3,  4 * 6(sp)\n"
-        "lw t4,  4 * 7(sp)\n"
-        "lw t5,  4 * 8(sp)\n"
-        "lw t6,  4 * 9(sp)\n"
-        "lw a0,  4 * 10(sp)\n"
-        "lw a1,  4 * 11(sp)\n"
-        "lw a2,  4 * 12(sp)\n"
-        "lw a3,  4 * 13(sp)\n"
-        "lw a4,  4 * 14(sp)\n"
-        "lw a5,  4 * 15(sp)\n"
-        "lw a6,  4 * 16(sp)\n"
-        "lw a7,  4 * 17(sp)\n"
-        "lw s0,  4 * 18(sp)\n"
-        "lw s1,  4 * 19(sp)\n"
-        "lw s2,  4 * 20(sp)\n"
-        "lw s3,  4 * 21(sp)\n"
-        "lw s4,  4 * 22(sp)\n"
-        "lw s5,  4 * 23(sp)\n"
-        "lw s6,  4 * 24(sp)\n"
-        "lw s7,  4 * 25(sp)\n"
-        "lw s8,  4 * 26(sp)\n"
-        "lw s9,  4 * 27(sp)\n"
-        "lw s10, 4 * 28(sp)\n"
-        "lw s11, 4 * 29(sp)\n"
-        "lw sp,  4 * 30(sp)\n"
-        "sret\n"
-    );
+    user_prepare(proc, vaddr, len, write);
+    uint32_t need = PAGE_V | PAGE_U | PAGE_R | (write ? PAGE_W : 0);
+    for (vaddr_t va = vaddr & ~(PAGE_SIZE - 1); va < vaddr + len; va += PAGE_SIZE){
+        uint32_t *pte = walk_pte(proc->page_table, va);
+        if(!pte || (*pte & need) != need){
+            return false;
+        }
+    }
+    return true;
 }
 
 /*
-    트랩 핸들러에 저장된 "registers at the time of exception"의 구조를 받는다.
+    사용자 공간의 NULL로 끝나는 문자열을 dst에 최대 max 바이트(NULL 포함)까지 복사하고 길이(NULL 제외)를 반환한다.
+    페이지를 넘어갈 때마다 그 페이지만 준비/확인하므로 문자열이 실제로 걸친 페이지만 건드린다.
+    문자열이 max보다 길거나 매핑되지 않은 주소를 만나면 -1을 반환한다.
 */
-void handle_syscall(struct trap_frame *f){
-    switch(f->a3){
-        case SYS_READFILE:
-        case SYS_WRITEFILE: {
-            /*
-                현재 사용자 공간의 포인터를 직접 참조하고 있는 문제가 있음 
-                => 사용자가 임의의 메모리 영역을 지정할 수 있다면 시스템 호출을 통해 커널 메모리 영역을 읽고 쓸 수 잇음
-            */
-            const char *filename = (const char *) f->a0;
-            char *buf = (char *)f->a1;
-            int len = f->a2;
-            struct file *file = fs_lookup(filename);
-            if(!file) {
-                printf("file not found: %s\n", filename);
-                f->a0 = -1;
-                break;
-            }
+int user_copy_str(struct process *proc, char *dst, vaddr_t src, size_t max){
+    for (size_t len = 0; len < max; len++){
+        if((len == 0 || is_aligned(src + len, PAGE_SIZE)) && !user_check(proc, src + len, 1, false)){
+            return -1;
+        }
 
-            if(len > (int)sizeof(file->data)){
-                len = file->size;
-            }
+        dst[len] = *(const char *) (src + len);
+        if(dst[len] == '\0'){
+            return len;
+        }
+    }
+    return -1;
+}
 
-            if(f->a3 == SYS_WRITEFILE){
-                memcpy(file->data, buf, len);
-                file->size = len;
-                fs_flush();
-            } else {
-                memcpy(buf, file->data, len);
-            }
+/*
+    Sv32의 1단계 페이지 테이블 항목에 R/W/X 비트가 설정되어 있으면 2단계 테이블을 거치지 않는 4MB 크기의 리프(메가페이지)가 된다.
+    vaddr와 paddr 모두 4MB 경계에 정렬되어 있어야 한다.
+*/
+void map_megapage(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags){
+    if(!is_aligned(vaddr, MEGAPAGE_SIZE) || !is_aligned(paddr, MEGAPAGE_SIZE)) {
+        PANIC("unaligned megapage vaddr=%x paddr=%x", vaddr, paddr);
+    }
 
-            f->a0 = len;
-            break;
+    table1[(vaddr >> 22) & 0x3ff] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
+}
+
+// [start, end) 영역을 vaddr == paddr로 매핑한다. 4MB 단위로 정렬된 구간은 메가페이지, 나머지는 4KB 페이지를 사용한다.
+void map_identity_range(uint32_t *table1, paddr_t start, paddr_t end, uint32_t flags){
+    paddr_t paddr = start;
+    while(paddr < end){
+        if(is_aligned(paddr, MEGAPAGE_SIZE) && end - paddr >= MEGAPAGE_SIZE){
+            map_megapage(table1, paddr, paddr, flags);
+            paddr += MEGAPAGE_SIZE;
+        } else {
+            map_page(table1, paddr, paddr, flags);
+            paddr += PAGE_SIZE;
         }
-        case SYS_EXIT:
-            printf("process %d exited\n", current_proc->pid);
-            /*
-                간단히 표현하기 위해 PROC_EXITED 플래그만 표시했지만 실질적인 OS는 페이지 테이블, 할당된 메모리 영역과 같이 프로세스가 보유한 리소스를 정리해야됨
-            */
-            current_proc->state = PROC_EXITED;
-            yield();
-            PANIC("unreachable");
-        /*
-            getchar 시스템 호출은 문자가 입력될때까지 SBI를 반복적으로 호출한다.
-            단순 반복이면 CPU를 점유하기에 다른 프로세스에 양보하기 위해 yield호출
-        */
-        case SYS_GETCHAR:
-            while(1){
-                long ch = getchar();
-                if (ch >= 0){
-                    f->a0 = ch;
-                    break;
-                }
+    }
+}
 
-                yield();
-            }
-            break;
+/*
+    ASID 할당
+    satp에 ASID를 함께 기록하면 TLB 항목이 ASID로 구분되므로 프로세스를 전환할 때마다 TLB 전체를 비울 필요가 없다.
+    ASID 0은 커널 페이지 테이블과 유휴 프로세스가 사용한다.
 
-        case SYS_PUTCHAR:
-            putchar(f->a0);
-            break;
-        default:
-            PANIC("unexpected syscall a3=%x\n", f->a3);
+    ASID는 세대(generation) 단위로 1부터 순서대로 나눠준다. 모두 소진하면 세대를 올리고 TLB 전체를 한 번 비운다.
+    이전 세대의 ASID를 가진 프로세스는 다음에 실행될 때 새 ASID를 받으므로 같은 세대 안에서 ASID가 두 주소 공간에 쓰이는 일은 없다.
+    종료된 프로세스의 ASID도 같은 세대 안에서는 재사용되지 않으므로 종료 시 TLB를 비우지 않아도 된다.
+*/
+unsigned asid_max;            // 지원하는 가장 큰 ASID (0이면 ASID 미지원)
+unsigned asid_generation = 1; // 현재 세대. proc->asid_gen이 0이면 아직 ASID가 없는 프로세스
+unsigned asid_next = 1;       // 현재 세대에서 다음에 할당할 ASID
+
+void asid_assign(struct process *proc){
+    if(proc == idle_proc || asid_max == 0 || proc->asid_gen == asid_generation){
+        return;
     }
-}
 
-struct file *fs_lookup(const char *filename) {
-    for (int i = 0; i < FILES_MAX; i++) {
-        struct file *file = &files[i];
-        // printf("[debug] file: %s\n", file->name);
-        if (!strcmp(file->name, filename))
-            return file;
+    if(asid_next > asid_max){
+        asid_generation++;
+        asid_next = 1;
+        __asm__ __volatile__("sfence.vma x0, x0");
     }
 
-    return NULL;
+    proc->asid = asid_next++;
+    proc->asid_gen = asid_generation;
+
+    // 새 페이지 테이블에 대한 쓰기가 주소 변환보다 먼저 보이도록 해당 ASID 범위만 sfence.vma 한다.
+    __asm__ __volatile__("sfence.vma x0, %0" :: "r" (proc->asid));
+}
+
+// 실행 중이거나 TLB에 항목이 남아 있을 수 있는 주소 공간의 매핑을 바꾼 뒤 해당 페이지의 TLB 항목만 비운다.
+void tlb_flush_page(struct process *proc, vaddr_t vaddr){
+    if(asid_max == 0){
+        __asm__ __volatile__("sfence.vma %0, x0" :: "r" (vaddr));
+    } else if(proc->asid_gen == asid_generation){
+        __asm__ __volatile__("sfence.vma %0, %1" :: "r" (vaddr), "r" (proc->asid));
+    }
 }
 
+// proc의 사용자 매핑에 대한 TLB 항목을 모두 비운다.
+void tlb_flush_proc(struct process *proc){
+    if(asid_max == 0){
+        __asm__ __volatile__("sfence.vma");
+    } else if(proc->asid_gen == asid_generation){
+        __asm__ __volatile__("sfence.vma x0, %0" :: "r" (proc->asid));
+    }
+}
 
-// sret:: 트랩 핸들러에서 반환(프로그램 카운터, 작동 모드 등 복원)
 /*
-https://github.com/d0iasm/rvemu/blob/f55eb5b376f22a73c0cf2630848c03f8d5c93922/src/cpu.rs#L3357-L3400
-The RISC-V Reader 참조
-Supervisor-Mode Exception handler에서 Return한다. 
-PC(Program Counter)를 CSRs(sepc)에 저장하고 privilege mode를 CSRs[sstatus].SPP, 
-CSRs(sstatus).SIE를 CSRs[sstatus].SPIE에 저장, CSR[sstatus].SPIE를 1로 세팅 그리고 CSPs[sstatus].SPP를 0으로 세팅
-QEMU에서는 mstatus를 sstatus대신 사용
+    모든 프로세스가 공유하는 커널 페이지 테이블을 만든다.
+    __kernel_base ~ __free_ram_end 영역(약 66MB)을 4KB 페이지로 매핑하면 16000개가 넘는 항목과 17개의 2단계 테이블이 필요하다.
+    __kernel_base(0x80200000)는 4MB 경계가 아니므로 앞뒤 일부만 4KB 페이지로 매핑하고 나머지는 메가페이지로 매핑한다.
+    create_process는 이 테이블의 1단계 항목만 복사한다.
 */
+void kernel_vm_init(void){
+    /*
+        커널 매핑은 모든 주소 공간에서 동일하므로 PAGE_G(global)를 설정한다.
+        global 항목은 ASID와 관계없이 TLB에 남아 있으므로 프로세스를 전환해도 커널 영역의 TLB 미스가 발생하지 않는다.
+    */
+    kernel_page_table = (uint32_t *) alloc_pages(1);
+    map_identity_range(kernel_page_table, (paddr_t) __kernel_base, (paddr_t) __free_ram_end, PAGE_R | PAGE_W | PAGE_X | PAGE_G);
 
+    // 커널이 MMIO 레지스터에 접근할 수 있도록 virtio-blk MMIO 영역을 매핑한다.
+    map_page(kernel_page_table, VIRTIO_BLK_PADDR, VIRTIO_BLK_PADDR, PAGE_R | PAGE_W | PAGE_G);
+    map_page(kernel_page_table, UART_PADDR, UART_PADDR, PAGE_R | PAGE_W | PAGE_G);
 
-void handle_trap(struct trap_frame *f){
-    uint32_t scause = READ_CSR(scause);
-    uint32_t stval = READ_CSR(stval);
-    uint32_t user_pc = READ_CSR(sepc);
+    // PLIC 레지스터(0x0c000000 ~ 0x0c3fffff)는 4MB 경계에 있으므로 메가페이지 하나로 매핑한다.
+    map_megapage(kernel_page_table, PLIC_PADDR, PLIC_PADDR, PAGE_R | PAGE_W | PAGE_G);
 
     /*
-        ecall 명령어가 호출되었는지 여부는 scause 값을 확인하여 확인이 가능하다.
-        handle_syscall 함수를 호출하는 것 이외에도 sepc값에 4(ecall 명령어의 크기)를 더한다.
-        이는 sepc가 예외를 발생시킨 프로그램 카운터를 가리키며 이 카운터가 ecall 명령어를 가리키기 때문이다. 
-        이를 변경하지 않으면 커널이 같은 위치로 돌아가서 ecall 명령어가 반복적으로 실행된다.
+        satp의 ASID 필드에 모두 1을 써 보고 다시 읽으면 구현이 지원하는 ASID 비트를 알 수 있다. (WARL 필드)
+        커널 페이지 테이블은 vaddr == paddr로 매핑되어 있으므로 여기서 바로 페이징을 켜도 실행이 계속된다.
     */
-    if (scause == SCAUSE_ECALL){
-        handle_syscall(f);
-        user_pc += 4;
-    } else {
-        /*
-            scause가 2이면 프로그램이 잘못된 명령어를 실행하려고 시도했음을 의미 unimp의 예상동작
-            sepc의 값은 unimp 명령어가 호출되는 줄을 가리킴
-        */
-        PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval, user_pc);
-    }
-
-    WRITE_CSR(sepc, user_pc);
+    uint32_t satp = SATP_SV32 | ((uint32_t) kernel_page_table / PAGE_SIZE);
+    WRITE_CSR(satp, satp | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+    asid_max = (READ_CSR(satp) >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+    WRITE_CSR(satp, satp);
+    __asm__ __volatile__("sfence.vma");
+    printf("vm: asid_max=%d\n", asid_max);
 }
 
 /*
-프로그램이 메모리에 접근할 때 CPU는 지정된 주소(가상 주소)를 실제 주소로 변환한다.
-가상 주소를 물리적 주소에 매핑하는 테이블을 페이지 테이블이라고 함.
-페이지 테이블을 전환하면 동일한 가상 주소가 다른 물리적 주소를 가리킬 수 있음 
-이를 통해 메모리 공간(가상 주소 공간)을 격리하고 커널과 애플리케이션 메모리 영역을 분리하여 시스템보안 강화
+    페이지 테이블과 사용자 페이지(PAGE_U)를 모두 반환한다.
+    kernel_page_table에서 복사한 1단계 항목(공유 2단계 테이블, 메가페이지)은 다른 프로세스도 사용 중이므로 건너뛴다.
+*/
+void free_page_table(uint32_t *table1){
+    for (int vpn1 = 0; vpn1 < 1024; vpn1++){
+        if((table1[vpn1] & PAGE_V) == 0 || table1[vpn1] == kernel_page_table[vpn1]){
+            continue;
+        }
 
-2단계 페이지 테이블 사용하는 RISC-V의 페이징 메커니즘인 Sv32
-32비트 가상 주소는 1단계 페이지 테이블 인덱스(VPN[1]과 2단계 인덱스 VPN[0]으로 나눠진다.
+        uint32_t *table0 = (uint32_t *)((table1[vpn1] >> 10) * PAGE_SIZE);
+        for (int vpn0 = 0; vpn0 < 1024; vpn0++){
+            if((table0[vpn0] & PAGE_V) && (table0[vpn0] & PAGE_U)){
+                page_put((table0[vpn0] >> 10) * PAGE_SIZE);
+            }
+        }
 
-동일한 4KB 페이지 내의 주소는 동일한 페이지 테이블 항목에 있음
-메모리에 접근할 때 CPU는 VPN[1], VPN[0]을 계산하여 상응하는 페이지테이블의 엔트리를 찾고 읽어서 매핑된 물리주소를 읽음
-그리고 offset을 더해서 물리주소를 얻음 
+        free_pages((paddr_t) table0, 1);
+    }
+
+    free_pages((paddr_t) table1, 1);
+}
+
+/*
+    종료된 프로세스가 보유한 메모리를 반환한다.
+    종료하는 프로세스는 자신의 페이지 테이블 위에서 실행 중이므로 해제하기 전에 커널 페이지 테이블로 전환한다.
+    커널 스택은 procs 배열에 있으므로 yield로 다른 프로세스에 전환할 때까지 계속 사용할 수 있다.
 */
+void release_process(struct process *proc){
+    close_fds(proc);
+    WRITE_CSR(satp, SATP_SV32 | ((uint32_t) kernel_page_table / PAGE_SIZE));
+
+    free_page_table(proc->page_table);
+    proc->page_table = NULL;
+    image_put(proc->image);
+    proc->image = NULL;
+}
 
 /*
-링커 스크립트의 ALIGN(4096)으로 인해 __free_ram은 4KB 경계에 배치됨.
-따라서 alloc_pages 함수는 항상 4KB에 정렬된 주솔르 반환한다. __free_ram_end를 초과해서 할당을 시도하면, 메모리 부족으로 커널 패닉 발생
+    parent의 사용자 페이지를 child 페이지 테이블에 같은 물리 페이지로 매핑한다. (copy-on-write)
+    쓰기 가능한 페이지는 양쪽 모두 쓰기 권한을 빼고 PAGE_COW로 표시하여, 먼저 쓰는 쪽이 cow_fault에서 복사본을 받는다.
+    페이지 내용은 복사하지 않고 2단계 페이지 테이블과 참조 수만 늘어난다.
+*/
+void uvm_copy_cow(uint32_t *parent, uint32_t *child){
+    for (int vpn1 = 0; vpn1 < 1024; vpn1++){
+        if((parent[vpn1] & PAGE_V) == 0 || parent[vpn1] == kernel_page_table[vpn1]){
+            continue;
+        }
 
-메모리 해제를 위해서는 비트맵 기반 알고리즘이나 버디시스템 알고리즘 사용
- */
-paddr_t alloc_pages(uint32_t n){
-    // 정적 변수로 정의함. 전역 변수 처럼 동작
-    // 할당할 다음 영역의 시작 주소를 가리킨다. 할당할 때 next_paddr은 할당되는 크기만큼 전진
-    // next_paddr은 처음 __free_ram의 주소를 보유. 즉, 메모리는 __free_ram 부터 순차적으로 할당된다.
-    static paddr_t next_paddr = (paddr_t) __free_ram;
-    paddr_t paddr = next_paddr;
-    next_paddr += n * PAGE_SIZE;
-
-    if(next_paddr > (paddr_t) __free_ram_end){
-        PANIC("out of memory");
-    }
+        uint32_t *table0 = (uint32_t *)((parent[vpn1] >> 10) * PAGE_SIZE);
+        for (int vpn0 = 0; vpn0 < 1024; vpn0++){
+            uint32_t pte = table0[vpn0];
+            if((pte & PAGE_V) == 0 || (pte & PAGE_U) == 0){
+                continue;
+            }
 
-    memset((void *)paddr, 0, n * PAGE_SIZE);
-    return paddr;
+            if(pte & PAGE_W){
+                pte = (pte & ~PAGE_W) | PAGE_COW;
+                table0[vpn0] = pte;
+            }
+
+            paddr_t page = (pte >> 10) * PAGE_SIZE;
+            page_get(page);
+            map_page(child, (vpn1 << 22) | (vpn0 << 12), page, pte & 0x3ff & ~PAGE_V);
+        }
+    }
 }
 
 /*
-1단계 페이지 테이블(table1), 가상 주소(vaddr), 물리 주소(paddr), 페이지 테이블 항목 플래그를 받음
-두 번째 수준의 페이지 테이블을 준비하고 두 번째 수준의 페이지 테이블 항목을 채운다.
-항목에 실제 주소 자체가 아니라 실제 페이지 번호가 포함되어야 하므로 paddr을 PAGE_SIZE로 나눈다. 
- */
-void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags){
-    if(!is_aligned(vaddr, PAGE_SIZE)) {
-        PANIC("unaligned vaddr %x", vaddr);
+    현재 프로세스를 복제한다. 자식은 부모의 트랩 프레임을 그대로 가지고 fork_ret을 거쳐 ecall 다음 명령어부터 실행하며, a0(반환 값)만 0이다.
+    사용자 메모리는 uvm_copy_cow로 공유하고, 열린 파일은 open_file을 공유한다.
+*/
+struct process *fork(struct trap_frame *f){
+    struct process *parent = current_proc;
+    struct process *child = proc_alloc();
+    if(!child){
+        return NULL;
     }
 
-    if(!is_aligned(paddr, PAGE_SIZE)) {
-        PANIC("unaligned paddr: %x", paddr);
+    uint32_t *page_table = (uint32_t *) alloc_pages(1);
+    memcpy(page_table, kernel_page_table, PAGE_SIZE);
+    uvm_copy_cow(parent->page_table, page_table);
+
+    // 부모의 쓰기 가능 페이지가 읽기 전용으로 바뀌었으므로 부모의 TLB 항목을 비운다.
+    tlb_flush_proc(parent);
+
+    struct trap_frame *child_frame = (struct trap_frame *) &child->stack[sizeof(child->stack) - sizeof(*f)];
+    memcpy(child_frame, f, sizeof(*f));
+    child_frame->a0 = 0;
+
+    uint32_t *sp = (uint32_t *) &child->stack[sizeof(child->stack) - sizeof(*f)];
+    for (int i = 0; i < 11; i++){
+        *--sp = 0;                  // s11 ~ s1
     }
+    *--sp = READ_CSR(sepc) + 4;     // s0: ecall 다음 명령어
+    *--sp = (uint32_t) fork_ret;    // ra
 
-    uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
-    if ((table1[vpn1] & PAGE_V) == 0){
-        // Create the non-existent 2nd level page table
-        uint32_t pt_paddr = alloc_pages(1);
-        table1[vpn1] = ((pt_paddr / PAGE_SIZE) << 10) | PAGE_V; 
+    for (int fd = 0; fd < FD_MAX; fd++){
+        child->fds[fd] = parent->fds[fd];
+        if(child->fds[fd]){
+            child->fds[fd]->refcnt++;
+        }
     }
 
-    // set the 2nd level page table entry to map the physical page.
-    uint32_t vpn0 = (vaddr >> 12) & 0x3ff;
-    uint32_t *table0 = (uint32_t *)((table1[vpn1] >> 10) * PAGE_SIZE);
-    table0[vpn0] = ((paddr / PAGE_SIZE) << 10 | flags | PAGE_V);
+    memcpy(child->vmas, parent->vmas, sizeof(parent->vmas));
+    child->nvmas = parent->nvmas;
+    child->image = parent->image;
+    if(child->image){
+        child->image->refcnt++;
+    }
+    child->mmap_next = parent->mmap_next;
+    child->priority = parent->priority;
+    child->page_table = page_table;
+    child->sp = (uint32_t) sp;
+    child->state = PROC_RUNNABLE;
+    rq_push(child);
+    return child;
 }
 
 struct process *proc_a; 
@@ -821,14 +3507,104 @@ struct process *proc_b;
     프로세스 수가 많아지면 선택에 있어 골치아픔 -> 스케줄러 구현
 */
 
-void yield(void){
-    struct process *next = idle_proc;
-    for(int i=0;i < PROCS_MAX; i++){
-        struct process *proc = &procs[(current_proc->pid + i) % PROCS_MAX];
-        if(proc->state == PROC_RUNNABLE && proc->pid > 0){
-            next = proc; 
-            break;
+/*
+    실행 큐 (run queue)
+    우선순위 단계(PRIO_LEVELS)마다 실행 가능한 프로세스의 FIFO 큐를 두고, 비어 있지 않은 단계를 ready_bitmap에 표시한다.
+    다음 프로세스는 ready_bitmap의 가장 낮은 비트(가장 높은 우선순위)를 __builtin_ctz로 찾아 해당 큐의 맨 앞에서 꺼내므로
+    프로세스 수와 관계없이 상수 시간에 선택된다.
+    큐는 process 구조체 안의 rq_next로 연결하는 침입형(intrusive) 리스트이므로 별도의 메모리 할당이 필요 없다.
+
+    실행 중인 프로세스(current_proc)와 유휴 프로세스는 큐에 들어있지 않다.
+*/
+struct run_queue {
+    struct process *head;
+    struct process *tail;
+};
+
+struct run_queue run_queues[PRIO_LEVELS];
+uint32_t ready_bitmap;
+
+void rq_push(struct process *proc){
+    struct run_queue *rq = &run_queues[proc->priority];
+    proc->rq_next = NULL;
+    if(rq->tail){
+        rq->tail->rq_next = proc;
+    } else {
+        rq->head = proc;
+    }
+
+    rq->tail = proc;
+    ready_bitmap |= 1u << proc->priority;
+}
+
+struct process *rq_pop(void){
+    if(!ready_bitmap){
+        return NULL;
+    }
+
+    struct run_queue *rq = &run_queues[__builtin_ctz(ready_bitmap)];
+    struct process *proc = rq->head;
+    rq->head = proc->rq_next;
+    if(!rq->head){
+        rq->tail = NULL;
+        ready_bitmap &= ~(1u << proc->priority);
+    }
+
+    proc->rq_next = NULL;
+    return proc;
+}
+
+// 큐 중간에 있는 프로세스를 꺼낸다. 우선순위를 바꿀 때만 사용하므로 해당 단계의 큐를 순회해도 충분하다.
+void rq_remove(struct process *proc){
+    struct run_queue *rq = &run_queues[proc->priority];
+    struct process *prev = NULL;
+    for (struct process *p = rq->head; p; prev = p, p = p->rq_next){
+        if(p != proc){
+            continue;
         }
+
+        if(prev){
+            prev->rq_next = p->rq_next;
+        } else {
+            rq->head = p->rq_next;
+        }
+
+        if(rq->tail == p){
+            rq->tail = prev;
+        }
+
+        if(!rq->head){
+            ready_bitmap &= ~(1u << proc->priority);
+        }
+
+        proc->rq_next = NULL;
+        return;
+    }
+}
+
+// 프로세스의 우선순위를 바꾼다. 큐에서 기다리는 중이면 새 우선순위의 큐로 옮긴다.
+void set_priority(struct process *proc, int priority){
+    bool queued = proc != current_proc && proc != idle_proc && proc->state == PROC_RUNNABLE;
+    if(queued){
+        rq_remove(proc);
+    }
+
+    proc->priority = priority;
+    if(queued){
+        rq_push(proc);
+    }
+}
+
+void yield(void){
+    // 현재 프로세스가 계속 실행 가능하면 같은 우선순위 큐의 맨 뒤로 보낸다.
+    if(current_proc != idle_proc && current_proc->state == PROC_RUNNABLE){
+        rq_push(current_proc);
+    }
+
+    // 모든 큐가 비어 있으면 유휴 프로세스를 실행한다.
+    struct process *next = rq_pop();
+    if(!next){
+        next = idle_proc;
     }
 
     // 실행할 수 있는 프로세스가 없다면
@@ -837,8 +3613,8 @@ void yield(void){
     }
 
     // 스택포인터는 낮은 주소로 확장되므로 커널 스택의 초기 값으로 sizeof(next->stack)번째 바이트의 주소를 설정한다.
+    asid_assign(next);
     __asm__ __volatile__(
-        "sfence.vma\n"
         /*
              satp     80080258인것을 확인할 수 있음
              RISC_V Sv32모드에 따라 이 값을 해석하면 첫 번째 레벨 페이지 테이블의 시작 물리적 주소를 알 수 있음
@@ -862,10 +3638,9 @@ void yield(void){
         */
         /* satp에서 1단계 페이지 테이블을 지정하여 페이지 테이블을 전환할 수 있다. */
         "csrw satp, %[satp]\n"
-        "sfence.vma\n"
         "csrw sscratch, %[sscratch]\n"
         :
-        :   [satp] "r" (SATP_SV32 | ((uint32_t) next->page_table / PAGE_SIZE)), 
+        :   [satp] "r" (SATP_SV32 | (next->asid << SATP_ASID_SHIFT) | ((uint32_t) next->page_table / PAGE_SIZE)), 
             [sscratch] "r" ((uint32_t) &next->stack[sizeof(next->stack)])
     );
     /*
@@ -875,14 +3650,45 @@ void yield(void){
         
         커널이 시작되면 기본적으로 페이징이 비활성화됨. (satp 레지스터가 설정되지 않음)
         가상 주소는 실제 주소와 일치하는 것처럼 동작
+
+        ASID를 사용하면 TLB 항목이 주소 공간별로 구분되므로 전환할 때마다 sfence.vma를 실행할 필요가 없다. (asid_assign 참고)
+        ASID를 지원하지 않는 구현에서는 이전처럼 전환할 때마다 TLB 전체를 비운다.
     */
+    if(asid_max == 0){
+        __asm__ __volatile__("sfence.vma");
+    }
 
     // Context Switch
     struct process *prev = current_proc;
+    uint32_t now = READ_CSR(time);
+    account_runtime(prev, now);
+    next->last_start = now;
+    next->nr_switches++;
+    timer_arm(next);
+
     current_proc = next;
     switch_context(&prev->sp, &next->sp);
 }
 
+/*
+    프로세스 목록과 스케줄링 통계를 출력한다. time slice 길이를 조정할 때 참고한다.
+    runtime: 누적 실행 시간(커널에서 프로세스를 대신해 실행한 시간 포함), switches: 실행된 횟수, preempts: 타이머에 의해 선점된 횟수
+*/
+void dump_procs(void){
+    static const char *states[] = {"unused", "runnable", "exited", "blocked"};
+    account_runtime(current_proc, READ_CSR(time));
+    for (int i = 0; i < PROCS_MAX; i++){
+        struct process *proc = &procs[i];
+        if(proc->state == PROC_UNUSED){
+            continue;
+        }
+
+        printf("pid=%d state=%s prio=%d runtime=%dms switches=%d preempts=%d slice=%dms create=%dticks\n",
+               proc->pid, states[proc->state], proc->priority, proc->runtime_ms, proc->nr_switches, proc->nr_preempts,
+               proc->time_slice / TIMER_TICKS_PER_MS, proc->create_ticks);
+    }
+}
+
 void proc_a_entry(void){
     printf("starting process A\n");
     while(1){
@@ -933,7 +3739,15 @@ void kernel_main(void){
     // stvec 레지스터에 예외 처리기의 주소를 저장한다.
     WRITE_CSR(stvec, (uint32_t) kernel_entry);
 
+    kernel_vm_init();
+
+    // S-Mode 타이머 인터럽트를 활성화한다. (선점형 스케줄링)
+    WRITE_CSR(sie, READ_CSR(sie) | SIE_STIE);
+
+    plic_init();
+    uart_init();
     virtio_blk_init();
+    bcache_init();
     fs_init();
 
 //     char buf[SECTOR_SIZE];
@@ -954,14 +3768,29 @@ void kernel_main(void){
         current_proc = idle_proc를 통해 부팅 프로세스의 실행 컨텍스트가 유휴 프로세스의 실행 컨텍스트로 저장되고 복원된다.
         반환 함수를 처음 호출하는 동안 유휴 프로세스에서 프로세스 A로 전환하고, 다시 유휴 프로세스로 전환할 때는 이 반환 함수 호출에서 반환하는 것처럼 동작한다.
     */
-    idle_proc = create_process(NULL, 0);
+    idle_proc = create_process(NULL);
     idle_proc->pid = -1; // IDLE
+    rq_remove(idle_proc); // 유휴 프로세스는 실행 큐에 넣지 않는다. (yield 참고)
     current_proc = idle_proc;
 
-    create_process(_binary_shell_bin_start, (size_t)_binary_shell_bin_size);
+    struct image *shell = image_load(_binary_shell_elf_start, (size_t)_binary_shell_elf_size);
+    if(!shell){
+        PANIC("failed to load the embedded shell");
+    }
+    create_process(shell);
 
-    yield();
-    PANIC("booted!");
+    /*
+        유휴 프로세스: 실행할 프로세스가 없으면 빈 페이지를 미리 0으로 채워 두고, 더 할 일이 없으면 인터럽트가 올 때까지 기다린다.
+        커널은 인터럽트가 꺼진 상태로 실행되므로 페이지 하나를 채울 때마다 대기 중인 인터럽트를 처리하고 다시 yield한다.
+    */
+    for (;;){
+        yield();
+        if(zero_pool_fill()){
+            handle_external_irq();
+        } else {
+            idle_wait();
+        }
+    }
 }
 
 
@@ -986,8 +3815,10 @@ __attribute__((naked))
 void boot(void){
     __asm__ __volatile__(
         "mv sp, %[stack_top]\n" // Set the stack pointer
+        "csrs sstatus, %[vs]\n" // 벡터 명령을 사용하는 memset이 호출되기 전에 벡터 유닛을 켠다.
         "j kernel_main\n" // Jump to the kernel main function
         :
-        : [stack_top] "r" (__stack_top) // stack top 주소를 %[stack_top]에 넘김
+        : [stack_top] "r" (__stack_top), // stack top 주소를 %[stack_top]에 넘김
+          [vs] "r" (SSTATUS_VS)
     );
 }
\ No newline at end of file
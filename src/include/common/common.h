@@ -32,9 +32,53 @@ typedef uint32_t vaddr_t;
 #define SYS_EXIT 3
 #define SYS_READFILE 4
 #define SYS_WRITEFILE 5
+#define SYS_KSTAT 6
+#define SYS_SETPRIO 7
+#define SYS_UNLINK 8
+#define SYS_OPEN 9
+#define SYS_CLOSE 10
+#define SYS_READ 11
+#define SYS_WRITE 12
+#define SYS_LSEEK 13
+#define SYS_MMAP 14
+#define SYS_FORK 15
+#define SYS_SPAWN 16
+#define SYS_WAIT 17
+#define SYS_READLINE 18
+#define SYS_SETSLICE 19
+#define SYS_MUNMAP 20
+
+// 콘솔에 연결된 파일 디스크립터 (read/write)
+#define FD_STDIN  0
+#define FD_STDOUT 1
+#define FD_STDERR 2
+
+// open 플래그
+#define O_RDONLY 0x0
+#define O_WRONLY 0x1
+#define O_RDWR   0x2
+#define O_ACCMODE 0x3
+#define O_CREAT  0x100 // 파일이 없으면 만든다.
+#define O_TRUNC  0x200 // 파일 크기를 0으로 만든다.
+
+// mmap prot
+#define PROT_READ  0x1 // 읽기 전용으로 파일 페이지를 공유한다.
+#define PROT_WRITE 0x2 // 쓰기 가능한 private 매핑 (처음 쓸 때 페이지를 복사한다)
+
+// lseek whence
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
+
+// SYS_KSTAT으로 출력할 커널 통계 항목
+#define KSTAT_PAGES 1
+#define KSTAT_PROCS 2
+#define KSTAT_BCACHE 3
+#define KSTAT_MEMBENCH 4
 
 void *memset(void *buf, char c, size_t n);
 void *memcpy(void *dst, const void *src, size_t n);
 char *strcpy(char *dst, const char *src);
+size_t strlen(const char *s);
 int strcmp(const char *s1, const char *s2);
 void printf(const char *fmt, ...);
\ No newline at end of file
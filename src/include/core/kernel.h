@@ -47,6 +47,11 @@ struct trap_frame {
 #define PAGE_W (1 << 2) //  Writable
 #define PAGE_X (1 << 3) //  Executable
 #define PAGE_U (1 << 4) //  User (accessible in user mode)
+#define PAGE_G (1 << 5) //  Global (mapped in all address spaces, not flushed by ASID-scoped sfence.vma)
+#define PAGE_COW (1 << 8) // 소프트웨어용(RSW) 비트: 처음 쓸 때 복사해야 하는 copy-on-write 페이지
+#define SATP_ASID_SHIFT 22
+#define SATP_ASID_MASK  0x1ff // Sv32의 ASID는 9비트
+#define MEGAPAGE_SIZE (4 * 1024 * 1024) // 1단계 항목 하나가 매핑하는 크기 (Sv32 superpage)
 
 
 /*
@@ -73,10 +78,28 @@ struct sbiret {
 #define PANIC(fmt, ...)                                                        \
     do {                                                                       \
         printf("PANIC: %s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__);  \
+        uart_flush();                                                          \
         while (1) {}                                                           \
     } while (0)
 
 #define PROCS_MAX 8
+#define FD_MAX 16       // 프로세스당 최대 파일 디스크립터 수 (0~2는 콘솔용으로 비워둔다)
+#define FD_FIRST 3      // 파일에 할당하는 첫 번째 디스크립터
+#define VMA_MAX 8       // 프로세스당 최대 VMA 수
+#define FILE_NAME_MAX 100 // 파일 경로의 최대 길이 (tar 헤더의 name 필드 크기)
+
+/*
+    가상 메모리 영역(VMA). 이 범위의 페이지는 처음 접근할 때 할당해서 flags 권한으로 매핑한다.
+    src가 있으면 [src_vaddr, src_vaddr + src_size) 범위는 src에서 복사하고 나머지는 0으로 채운다.
+*/
+struct vma {
+    vaddr_t start;
+    vaddr_t end;
+    uint32_t flags;     // PAGE_R / PAGE_W / PAGE_X
+    const void *src;
+    vaddr_t src_vaddr;
+    size_t src_size;
+};
 #define PROC_UNUSED 0
 #define PROC_RUNNABLE 1
 
@@ -89,6 +112,23 @@ struct process {
     int state;         // 프로세스 상태 
     vaddr_t sp;         // 스택 포인터
     uint32_t *page_table;
+    uint32_t asid;       // satp에 기록할 주소 공간 ID
+    uint32_t asid_gen;   // asid를 할당받은 세대 (asid_assign)
+    uint32_t time_slice; // 한 번에 실행할 수 있는 시간 (time CSR tick)
+    uint32_t last_start; // 마지막으로 실행을 시작한(또는 실행 시간을 누적한) 시각
+    uint32_t runtime_ms; // 누적 실행 시간
+    uint32_t runtime_ticks; // runtime_ms에 아직 반영되지 않은 tick
+    uint32_t nr_switches; // 실행된 횟수
+    uint32_t nr_preempts; // 타이머 인터럽트로 선점된 횟수
+    uint32_t create_ticks; // create_process에 걸린 시간 (time CSR tick, KSTAT_PROCS로 확인)
+    int priority;        // 스케줄링 우선순위 (0이 가장 높음)
+    struct process *rq_next; // 실행 큐에서 다음 프로세스
+    void *wait_chan;     // PROC_BLOCKED일 때 기다리는 대상 (proc_sleep)
+    struct open_file *fds[FD_MAX]; // 파일 디스크립터 테이블 (fd -> 열린 파일)
+    vaddr_t mmap_next;   // 다음 mmap 매핑을 시작할 가상 주소
+    struct vma vmas[VMA_MAX]; // 처음 접근할 때 매핑하는 사용자 메모리 영역 (handle_page_fault)
+    int nvmas;
+    struct image *image; // 실행 중인 이미지 (VMA가 이미지의 ELF 데이터를 가리키므로 참조를 잡아 둔다)
     uint8_t stack[8192]; // 커널 스택
 };
 /*
@@ -98,24 +138,216 @@ seL4는 이 방식을 채택. "where to store the program's context" 문제는 G
 => stackless async 검색
 */
 
+/*
+    alloc_pages가 관리하는 동적 할당 영역의 크기.
+    This needs to match the size of the __free_ram region defined in 'kernel.ld'
+*/
+#define FREE_RAM_SIZE  (64 * 1024 * 1024)
+#define FREE_RAM_PAGES (FREE_RAM_SIZE / PAGE_SIZE)
+
+// 페이지 할당기 통계 (단위: 페이지)
+struct page_stats {
+    unsigned used;   // 현재 사용 중인 페이지 수
+    unsigned peak;   // used의 최댓값
+    unsigned allocs; // alloc_pages 호출 횟수
+    unsigned frees;  // free_pages 호출 횟수
+    unsigned zero_hits;   // 미리 0으로 채운 페이지로 처리한 1페이지 할당 수
+    unsigned zero_misses; // 풀이 비어 있어 그 자리에서 0으로 채운 1페이지 할당 수
+};
+
+#define ZERO_POOL_MAX 64 // 유휴 프로세스가 미리 0으로 채워 두는 페이지 수
+
 paddr_t alloc_pages(uint32_t n);
+void free_pages(paddr_t paddr, uint32_t n);
+void page_get(paddr_t paddr);
+void page_put(paddr_t paddr);
+unsigned page_refcount(paddr_t paddr);
+uint32_t *walk_pte(uint32_t *table1, vaddr_t vaddr);
+bool cow_fault(struct process *proc, vaddr_t vaddr);
+void uvm_copy_cow(uint32_t *parent, uint32_t *child);
+struct vma *vma_find(struct process *proc, vaddr_t vaddr);
+void vma_add(struct process *proc, const struct vma *vma);
+bool handle_page_fault(struct process *proc, uint32_t scause, vaddr_t vaddr);
+void user_prepare(struct process *proc, vaddr_t vaddr, size_t len, bool write);
+bool user_check(struct process *proc, vaddr_t vaddr, size_t len, bool write);
+int user_copy_str(struct process *proc, char *dst, vaddr_t src, size_t max);
+unsigned free_page_count(void);
+bool zero_pool_fill(void);
+void zero_pool_drain(void);
+void dump_page_stats(void);
 void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags);
+void map_megapage(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags);
+void map_identity_range(uint32_t *table1, paddr_t start, paddr_t end, uint32_t flags);
+void kernel_vm_init(void);
+void free_page_table(uint32_t *table1);
 
 /*
     The base virtual address of an application image.
     This neds to match the starting address defined in 'user.ld'
 */
 #define USER_BASE 0x1000000
+/*
+    mmap으로 파일 페이지를 매핑하는 사용자 가상 주소 영역.
+    커널 페이지 테이블이 매핑하는 PLIC(0x0c000000) 영역 앞에서 끝난다.
+*/
+#define USER_END  0x1800000 // 실행 이미지와 .bss, 스택이 차지할 수 있는 영역의 끝 (user.ld의 ASSERT와 맞춰야 한다)
+#define ARGS_BASE 0x1800000 // spawn이 프로그램 인자를 매핑하는 페이지
+#define ARGS_MAX  16
+#define MMAP_BASE 0x2000000
+#define MMAP_END  0x0c000000
 
 /*
 애플리케이션을 실행하려면 사용자 모드라고 하는 CPU모드, 즉 RISC-V 용어로는 U-Mode를 사용
 U-Mode로 전환하는 방법은 아래와 같음
 */
 #define SSTATUS_SPIE (1 << 5)
+/*
+    커널을 벡터 확장으로 빌드하면(run.sh의 RVV=1) memcpy/memset 등이 벡터 명령을 사용하므로 커널에서는 sstatus.VS를 Initial로 켜 둔다.
+    VS가 Off(0)이면 벡터 명령은 illegal instruction 예외를 일으킨다.
+    U-Mode로 돌아갈 때는(trap_return) VS 필드 전체(SSTATUS_VS_MASK)를 지워 사용자 프로그램이 벡터 레지스터를 읽지 못하게 한다.
+*/
+#ifdef __riscv_vector
+#define SSTATUS_VS      (1 << 9)
+#define SSTATUS_VS_MASK (3 << 9)
+#else
+#define SSTATUS_VS      0
+#define SSTATUS_VS_MASK 0
+#endif
 #define SCAUSE_ECALL 8
+#define SCAUSE_INST_PAGE_FAULT 12
+#define SCAUSE_LOAD_PAGE_FAULT 13
+#define SCAUSE_STORE_PAGE_FAULT 15
 #define PROC_EXITED 2
+#define PROC_BLOCKED 3 // 인터럽트 등 이벤트를 기다리는 중 (proc_sleep)
+
+/*
+    타이머 인터럽트와 선점형 스케줄링
+    scause의 최상위 비트가 1이면 예외가 아닌 인터럽트이고 나머지 비트가 인터럽트 번호이다.
+    QEMU virt 머신의 time CSR은 10MHz로 증가한다. (device tree의 timebase-frequency)
+*/
+#define SCAUSE_INTERRUPT (1u << 31)
+#define IRQ_S_TIMER 5
+#define SIE_STIE (1 << IRQ_S_TIMER)
+#define IRQ_S_EXTERNAL 9
+#define SIE_SEIE (1 << IRQ_S_EXTERNAL)
+#define SBI_EXT_TIME 0x54494D45
+#define TIMER_FREQ 10000000
+#define TIMER_TICKS_PER_MS (TIMER_FREQ / 1000)
+#define TIME_SLICE_MS 10
+#define TIME_SLICE_DEFAULT (TIME_SLICE_MS * TIMER_TICKS_PER_MS)
+#define TIME_SLICE_MAX_MS 1000 // SYS_SETSLICE로 설정할 수 있는 최대 시간 조각
+
+// 우선순위 단계 수. 0이 가장 높고 같은 단계 안에서는 라운드 로빈으로 실행된다.
+#define PRIO_LEVELS  8
+#define PRIO_DEFAULT 4
 
 void yield(void);
+void rq_push(struct process *proc);
+struct process *rq_pop(void);
+void rq_remove(struct process *proc);
+void set_priority(struct process *proc, int priority);
+void proc_sleep(void *chan);
+void proc_wakeup(void *chan);
+// ELF32 (https://refspecs.linuxfoundation.org/elf/elf.pdf)
+#define ELFCLASS32  1
+#define ELFDATA2LSB 1
+#define ET_EXEC     2
+#define EM_RISCV    243
+#define PT_LOAD     1
+#define PF_X        0x1
+#define PF_W        0x2
+#define PF_R        0x4
+
+struct elf32_ehdr {
+    uint8_t e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint32_t e_entry;
+    uint32_t e_phoff;
+    uint32_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} __attribute__((packed));
+
+struct elf32_phdr {
+    uint32_t p_type;
+    uint32_t p_offset;
+    uint32_t p_vaddr;
+    uint32_t p_paddr;
+    uint32_t p_filesz;
+    uint32_t p_memsz;
+    uint32_t p_flags;
+    uint32_t p_align;
+} __attribute__((packed));
+
+// 같은 이미지로 만든 모든 프로세스가 공유하는 쓰기 불가능한 페이지
+struct image_page {
+    vaddr_t vaddr;
+    paddr_t paddr;
+    uint32_t flags;     // PAGE_R / PAGE_X
+};
+
+/*
+    ELF 실행 파일에서 불러온 이미지 (image_load)
+    쓰기 불가능한 세그먼트는 공유 페이지(pages)로, 쓰기 가능한 세그먼트는 프로세스마다 복사할 VMA 틀(vmas)로 가지고 있다.
+*/
+#define IMAGES_MAX 8
+#define IMAGE_SEGS_MAX 4
+struct image {
+    const void *data;           // ELF 파일 전체
+    char path[FILE_NAME_MAX];   // 디스크에서 불러온 경우 경로 (image_open 캐시)
+    uint32_t file_gen;          // 불러올 때의 file->gen
+    int refcnt;                 // 이미지로 실행 중인 프로세스 수 + 캐시에 있으면 1
+    bool cached;                // image_open이 경로로 찾을 수 있는지
+    size_t size;
+    uint32_t entry;             // 진입점 (e_entry)
+    vaddr_t end;                // 가장 높은 세그먼트의 끝 (페이지 경계)
+    struct image_page *pages;
+    unsigned npages;
+    unsigned pages_cap;         // pages 배열에 할당한 칸 수
+    struct vma vmas[IMAGE_SEGS_MAX];
+    int nvmas;
+};
+
+uint32_t elf_page_flags(uint32_t p_flags);
+struct image *image_load(const void *data, size_t size);
+struct image *image_open(const char *path);
+void image_put(struct image *img);
+struct process *spawn(const char *path, char **argv);
+struct process *create_process(struct image *img);
+void release_process(struct process *proc);
+struct process *proc_alloc(void);
+struct process *proc_lookup(int pid);
+struct process *fork(struct trap_frame *f);
+void asid_assign(struct process *proc);
+int console_write(const char *buf, int len);
+int console_read(char *buf, int len);
+uint64_t read_time(void);
+void sbi_set_timer(uint64_t stime_value);
+void timer_arm(struct process *proc);
+void account_runtime(struct process *proc, uint32_t now);
+void dump_procs(void);
+
+/*
+    memcpy/memset/strcpy/strcmp 마이크로벤치마크 (KSTAT_MEMBENCH)
+    벡터 확장으로 빌드한 것은 커널뿐이므로 커널에서 측정해야 RVV 구현을 측정할 수 있다.
+*/
+#define MEMBENCH_MIN   8
+#define MEMBENCH_MAX   (64 * 1024)
+#define MEMBENCH_BYTES (256 * 1024) // 크기마다 이만큼의 바이트를 처리하도록 반복한다
+
+uint32_t read_cycle(void);
+void membench_run(int which, uint8_t *src, uint8_t *dst, int size);
+void dump_membench(void);
+
+void tlb_flush_page(struct process *proc, vaddr_t vaddr);
+void tlb_flush_proc(struct process *proc);
 void switch_context(uint32_t *prev_sp, uint32_t *next_sp);
 
 /*
@@ -155,6 +387,8 @@ void switch_context(uint32_t *prev_sp, uint32_t *next_sp);
 #define VIRTIO_REG_QUEUE_PFN     0x40
 #define VIRTIO_REG_QUEUE_READY   0x44
 #define VIRTIO_REG_QUEUE_NOTIFY  0x50
+#define VIRTIO_REG_INTERRUPT_STATUS 0x60
+#define VIRTIO_REG_INTERRUPT_ACK    0x64
 #define VIRTIO_REG_DEVICE_STATUS 0x70
 #define VIRTIO_REG_DEVICE_CONFIG 0x100
 #define VIRTIO_STATUS_ACK       1
@@ -203,13 +437,17 @@ struct virtio_virtq {
     struct virtq_used used __attribute__((aligned(PAGE_SIZE)));
     int queue_index;
     volatile uint16_t *used_index;
-    uint16_t last_used_index;
+    uint16_t last_used_index; // 드라이버가 마지막으로 처리한 used ring 위치
+    uint16_t free_head;       // 빈 디스크립터 리스트의 첫 번째 (descs[].next로 연결)
+    uint16_t num_free;        // 빈 디스크립터 수
 } __attribute__((packed));
 
 // Virtio-blk request
 /*
-    매번 처리가 완료될때까지 바쁘게 기다리기 때문에 링의 처음 3개의 디스크립터를 사용하면된다.
-    하지만 실제로는 여러 요청을 동시에 처리하려면 사용 중이거나 사용 중인 디스크립터를 추적해야 한다.
+    요청은 헤더, 데이터, 상태 디스크립터의 체인이다. 데이터 디스크립터는 호출자의 버퍼를 직접 가리키며
+    물리적으로 연속된 영역마다 하나씩, 최대 BLK_SEGS_MAX개를 사용한다. (scatter-gather)
+    여러 요청을 동시에 처리하기 위해 빈 디스크립터 리스트(free_head)로 사용 중인 디스크립터를 추적하고,
+    헤더와 상태를 담는 요청 버퍼는 BLK_REQS_MAX개의 슬롯으로 나눠 사용한다.
 */
 struct virtio_blk_req {
     // First descriptor : read-only from the device
@@ -217,26 +455,145 @@ struct virtio_blk_req {
     uint32_t reserved;
     uint64_t sector;
 
-    // Second descriptor: writable by the device if it's a read operation(VIRTQ_DESC_F_WRITE)
-    uint8_t data[512];
-
-    // Thrid descriptor: writable by the device (VIRTQ_DESC_F_WRITE)
+    // Last descriptor: writable by the device (VIRTQ_DESC_F_WRITE)
     uint8_t status;
 } __attribute__((packed)); // 컴파일러가 구조체 패딩 없이 패킹하도록 지시
 
 
+#define BLK_REQS_MAX (VIRTQ_ENTRY_NUM / 3)  // 동시에 장치에 보낼 수 있는 요청 수
+#define BLK_SEGS_MAX (VIRTQ_ENTRY_NUM - 2)  // 요청 하나의 데이터 디스크립터 수 (헤더, 상태 제외)
+
+// 디스크 입출력 버퍼 목록의 항목. base는 커널 메모리(vaddr == paddr)여야 하고 len은 SECTOR_SIZE의 배수
+struct blk_iov {
+    void *base;
+    size_t len;
+};
+
+// 장치에 보낸 요청의 상태 (드라이버 전용)
+struct blk_request {
+    bool in_use;
+    volatile bool done;          // 장치가 처리를 끝냈는지 (virtio_blk_isr)
+    int head;                    // 요청의 첫 번째 디스크립터 번호
+    unsigned sector;
+    int is_write;
+    struct virtio_blk_req *vreq; // 장치와 공유하는 요청 버퍼
+    paddr_t vreq_paddr;
+};
+
 struct virtio_virtq *virtq_init(unsigned index);
 void virtq_kick(struct virtio_virtq *vq, int desc_index);
+int virtq_alloc_desc(struct virtio_virtq *vq);
+void virtq_free_chain(struct virtio_virtq *vq, int head);
 void virtio_blk_init(void);
-bool virtq_is_busy(struct virtio_virtq *vq);
-void read_write_disk(void *buf, unsigned sector, int is_write);
+void blk_wait(void *chan);
+int blk_iov_fit(const struct blk_iov *iov, int iovcnt);
+struct blk_request *blk_submit(unsigned sector, const struct blk_iov *iov, int iovcnt, int is_write, bool wait);
+int blk_finish(struct blk_request *req);
+int read_write_disk_iov(unsigned sector, const struct blk_iov *iov, int iovcnt, int is_write);
+int read_write_disk(void *buf, unsigned sector, int is_write);
+void read_write_disk_many(void *buf, unsigned sector, unsigned count, int is_write);
+void virtio_blk_isr(void);
 
-#define FILES_MAX      2
-#define DISK_MAX_SIZE  align_up(sizeof(struct file) * FILES_MAX, SECTOR_SIZE)
+/*
+    PLIC (QEMU virt 머신, hart 0의 S-Mode 컨텍스트 = 1)
+    https://github.com/qemu/qemu/blob/master/include/hw/riscv/virt.h
+*/
+#define PLIC_PADDR         0x0c000000
+#define PLIC_PRIORITY(irq) (PLIC_PADDR + (irq) * 4)
+#define PLIC_SENABLE       (PLIC_PADDR + 0x2080)
+#define PLIC_STHRESHOLD    (PLIC_PADDR + 0x201000)
+#define PLIC_SCLAIM        (PLIC_PADDR + 0x201004)
+#define VIRTIO_BLK_IRQ     1 // virtio-mmio-bus.0
+
+void plic_enable(unsigned irq);
+void plic_init(void);
+void handle_external_irq(void);
+void idle_wait(void);
 
 /*
-    파일 시스템 구현에서 모든 파일은 부팅 시 디스크에서 메모리에 읽혀진다.
-    FILES_MAX는 로드할 수 있는 최대 파일 수를 정의하고 DISK_MAX_SIZE는 디스크 이미지 최대 크기를 지정한다.
+    NS16550A UART (QEMU virt 머신의 시리얼 포트)
+    https://www.lammertbies.nl/comm/info/serial-uart
+*/
+#define UART_PADDR      0x10000000
+#define UART_IRQ        10
+#define UART_RBR        0 // 수신 버퍼 (읽기)
+#define UART_THR        0 // 송신 버퍼 (쓰기)
+#define UART_IER        1 // 인터럽트 활성화
+#define UART_FCR        2 // FIFO 제어 (쓰기)
+#define UART_LCR        3 // 라인 제어
+#define UART_MCR        4 // 모뎀 제어
+#define UART_LSR        5 // 라인 상태
+#define UART_IER_RDI    0x01 // 수신 데이터 인터럽트
+#define UART_IER_THRI   0x02 // 송신 버퍼 비어 있음 인터럽트
+#define UART_FCR_ENABLE 0x07 // FIFO 활성화 + 수신/송신 FIFO 비우기
+#define UART_LCR_8N1    0x03
+#define UART_MCR_OUT2   0x08 // 일부 구현은 OUT2가 켜져 있어야 인터럽트를 전달한다
+#define UART_LSR_DR     0x01 // 수신 데이터 있음
+#define UART_LSR_THRE   0x20 // 송신 FIFO 비어 있음
+#define UART_FIFO_SIZE  16
+#define UART_RING_SIZE  1024 // 2의 거듭제곱
+
+// head는 다음에 쓸 위치, tail은 다음에 읽을 위치이다. (계속 증가하고 인덱싱할 때만 나머지를 구한다)
+struct uart_ring {
+    char buf[UART_RING_SIZE];
+    uint32_t head;
+    uint32_t tail;
+};
+
+void uart_init(void);
+void uart_putc(char ch);
+void uart_tx_kick(void);
+void uart_flush(void);
+void uart_isr(void);
+
+#define TTY_LINE_MAX 256 // 편집 중인 한 줄의 최대 길이
+
+void tty_input(char ch);
+int tty_readline(char *buf, int len);
+
+/*
+    버퍼 캐시 (디스크 섹터 단위)
+    refcnt가 0이 아닌 버퍼는 교체되지 않는다. busy는 디스크에서 읽어 오는 중임을 뜻한다.
+*/
+#define BCACHE_RAM_DIV   16   // 부팅 시 남은 메모리의 1/16을 버퍼 캐시로 사용
+#define BCACHE_HASH_SIZE 1024
+#define BCACHE_IOV_MAX   32   // bsync, bcache_prefetch가 한 번에 묶는 섹터 수
+
+struct buf {
+    unsigned sector;
+    bool valid_sector;      // sector 필드가 유효한지 (해시 테이블에 들어 있는지)
+    bool valid;             // data에 디스크 내용이 들어 있는지
+    bool dirty;             // 디스크에 기록해야 하는지
+    bool busy;              // 디스크에서 읽는 중
+    int refcnt;
+    struct buf *hash_next;
+    struct buf *lru_prev;
+    struct buf *lru_next;
+    uint8_t *data;          // SECTOR_SIZE 바이트
+};
+
+struct bcache_stats {
+    unsigned hits;
+    unsigned misses;
+    unsigned evictions;
+    unsigned writebacks;
+};
+
+void bcache_init(void);
+struct buf *bget(unsigned sector);
+struct buf *bread(unsigned sector);
+void bwrite(struct buf *b);
+void brelse(struct buf *b);
+void bcache_prefetch(unsigned sector, unsigned count);
+int bsync(void);
+void dump_bcache_stats(void);
+
+extern unsigned blk_capacity;
+#define DISK_MAX_SIZE  blk_capacity // 디스크 이미지 최대 크기는 장치 용량을 따른다.
+
+/*
+    부팅 시에는 tar 헤더만 읽어 파일 목록을 만들고, 파일 내용은 처음 접근할 때 메모리에 읽혀진다.
+    파일 객체와 데이터 페이지는 필요할 때 할당하므로 파일 수와 크기는 메모리와 디스크 용량(DISK_MAX_SIZE)에만 제한된다.
 */
 struct tar_header {
     char name[100];
@@ -262,9 +619,34 @@ struct tar_header {
 
 struct file{
     bool in_use; // Indicates if this file entry is in use 
-    char name[100]; // file name
-    char data[1024]; //file content 
+    char name[FILE_NAME_MAX]; // file name
     size_t size; // file size
+    bool loaded; // 내용을 디스크에서 읽어왔는지 (fs_load)
+    paddr_t *pages;     // 파일 내용을 담은 페이지들의 주소 (PAGE_SIZE 단위)
+    unsigned npages;    // 할당된 데이터 페이지 수
+    unsigned pages_cap; // pages 배열에 담을 수 있는 항목 수
+    unsigned nopen;     // 이 파일을 가리키는 open_file 수
+    uint32_t gen;       // 내용이나 크기가 바뀔 때마다 새 값(fs_gen)을 받는다 (image_open 캐시 확인용)
+    struct file *next;  // 아카이브 순서의 다음 파일 (빈 객체일 때는 file_free_list의 다음 항목)
+
+    // 디스크 기록 상태 (fs_flush)
+    unsigned sector;    // tar 헤더가 있는 섹터
+    size_t disk_size;   // 디스크의 헤더에 기록된 크기
+    bool header_dirty;  // 헤더를 다시 기록해야 하는지
+    size_t dirty_start; // 기록해야 하는 데이터 영역 [dirty_start, dirty_end)
+    size_t dirty_end;
+};
+
+/*
+    open으로 연 파일. 디스크립터마다 별도의 오프셋을 가진다.
+    fork된 프로세스끼리는 같은 open_file을 공유하므로 refcnt로 관리한다.
+*/
+#define OPEN_FILES_MAX (PROCS_MAX * FD_MAX)
+struct open_file {
+    int refcnt;        // 이 항목을 가리키는 디스크립터 수 (0이면 빈 항목)
+    struct file *file;
+    size_t offset;     // 다음 read/write 위치
+    int flags;         // open에 전달한 O_* 플래그
 };
 
 /*
@@ -275,4 +657,27 @@ struct file{
 
 struct file *fs_lookup(const char *filename);
 void fs_init(void);
-void fs_flush(void);
\ No newline at end of file
+void fs_lock(void);
+void fs_unlock(void);
+struct file *file_alloc(void);
+void fs_reserve_pages(struct file *file, unsigned npages);
+void fs_resize(struct file *file, size_t size);
+int fs_read(struct file *file, size_t off, void *buf, size_t len);
+int fs_write(struct file *file, size_t off, const void *buf, size_t len);
+bool fs_fits(struct file *file, size_t size);
+#define FS_INDEX_DELETED ((struct file *) 1) // fs_index에서 삭제된 칸 표시
+uint32_t fs_hash(const char *name);
+void fs_index_insert(struct file *file);
+void fs_index_remove(struct file *file);
+void fs_index_rebuild(unsigned count);
+struct file *fs_create(const char *filename);
+int fs_delete(struct file *file);
+int fs_load(struct file *file);
+int fs_write_header(struct file *file);
+int fs_write_data_sector(struct file *file, unsigned index);
+void fs_mark_dirty(struct file *file, size_t off, size_t len);
+int fs_flush(void);
+int fd_alloc(struct process *proc, struct open_file *of);
+struct open_file *fd_get(struct process *proc, int fd);
+int file_close(struct open_file *of);
+void close_fds(struct process *proc);
\ No newline at end of file
@@ -1,9 +1,27 @@
 #pragma once
 #include "../common/common.h"
 
-int syscall(int sysno, int arg0, int arg1, int arg2);
+#define STDOUT_BUF_SIZE 128
+
+int syscall(int sysno, int arg0, int arg1, int arg2, int arg3);
+void flush(void);
 __attribute__((noreturn)) void exit(void);
 void putchar(char ch);
 int getchar(void);
+int readline(char *buf, int len);
 int readfile(const char *filename, char *buf, int len);
-int writefile(const char *filename, const char *buf, int len);
\ No newline at end of file
+int writefile(const char *filename, const char *buf, int len);
+int kstat(int which);
+int setpriority(int pid, int priority);
+int setslice(int pid, int ms);
+int unlink(const char *filename);
+int open(const char *filename, int flags);
+int close(int fd);
+int read(int fd, void *buf, int len);
+int write(int fd, const void *buf, int len);
+int lseek(int fd, int offset, int whence);
+void *mmap(int fd, int offset, int len, int prot);
+int munmap(void *addr, int len);
+int fork(void);
+int spawn(const char *path, char **argv);
+int wait(int pid);
\ No newline at end of file
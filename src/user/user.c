@@ -2,44 +2,119 @@
 
 extern char __stack_top[];
 
+/*
+    표준 출력 버퍼. putchar는 버퍼에 모아 두었다가 줄바꿈, 버퍼가 가득 찼을 때, 입력을 기다리기 전(getchar, readline),
+    wait/fork/exit 전에 write 시스템 콜 한 번으로 출력한다. 따라서 한 줄을 출력하는 데 트랩이 한 번만 발생한다.
+*/
+char stdout_buf[STDOUT_BUF_SIZE];
+int stdout_len;
+
+void flush(void){
+    if(stdout_len > 0){
+        write(FD_STDOUT, stdout_buf, stdout_len);
+        stdout_len = 0;
+    }
+}
+
 __attribute__((noreturn)) void exit(void){
-    syscall(SYS_EXIT, 0, 0, 0);
+    flush();
+    syscall(SYS_EXIT, 0, 0, 0, 0);
     for(;;);
 }
 
 /*
 ecall 명령어는 커널에 처리를 위임하는데 사용하는 특수 명령어이다. 
 ecall 명령어가 실행되면 예외 핸들러가 호출되고 제어권이 커널로 전송된다.
+인자는 a0~a2와 a4, 시스템 콜 번호는 a3으로 전달한다.
 커널의 반환 값은 a0레지스터에 설정된다.
 */
-int syscall(int sysno, int arg0, int arg1, int arg2) {
+int syscall(int sysno, int arg0, int arg1, int arg2, int arg3) {
     register int a0 __asm__("a0") = arg0;
     register int a1 __asm__("a1") = arg1;
     register int a2 __asm__("a2") = arg2;
     register int a3 __asm__("a3") = sysno;
+    register int a4 __asm__("a4") = arg3;
 
     __asm__ __volatile__("ecall"
                          : "=r"(a0)
-                         : "r"(a0), "r"(a1), "r"(a2), "r"(a3)
+                         : "r"(a0), "r"(a1), "r"(a2), "r"(a3), "r"(a4)
                          : "memory");
 
     return a0;
 }
 
 int readfile(const char *filename, char *buf, int len){
-    return syscall(SYS_READFILE, (int) filename, (int) buf, len);
+    return syscall(SYS_READFILE, (int) filename, (int) buf, len, 0);
 }
 
 int writefile(const char *filename, const char *buf, int len){
-    return syscall(SYS_WRITEFILE, (int) filename, (int) buf, len);
+    return syscall(SYS_WRITEFILE, (int) filename, (int) buf, len, 0);
 }
 
 void putchar(char ch){
-    syscall(SYS_PUTCHAR, ch, 0, 0);
+    stdout_buf[stdout_len++] = ch;
+    if(ch == '\n' || stdout_len == sizeof(stdout_buf)){
+        flush();
+    }
 }
 
 int getchar(void){
-    return syscall(SYS_GETCHAR, 0, 0, 0);
+    flush();
+    return syscall(SYS_GETCHAR, 0, 0, 0, 0);
+}
+
+// 한 줄을 읽는다. 줄 편집(에코, 백스페이스)은 커널이 처리한다. 줄이 buf보다 길면 -1을 반환한다.
+int readline(char *buf, int len){
+    flush();
+    return syscall(SYS_READLINE, (int) buf, len, 0, 0);
+}
+
+int kstat(int which){
+    return syscall(SYS_KSTAT, which, 0, 0, 0);
+}
+
+int setpriority(int pid, int priority){
+    return syscall(SYS_SETPRIO, pid, priority, 0, 0);
+}
+
+// pid(0이면 자기 자신)의 시간 조각을 ms 밀리초로 바꾼다.
+int setslice(int pid, int ms){
+    return syscall(SYS_SETSLICE, pid, ms, 0, 0);
+}
+
+int unlink(const char *filename){
+    return syscall(SYS_UNLINK, (int) filename, 0, 0, 0);
+}
+
+int open(const char *filename, int flags){
+    return syscall(SYS_OPEN, (int) filename, flags, 0, 0);
+}
+
+int close(int fd){
+    return syscall(SYS_CLOSE, fd, 0, 0, 0);
+}
+
+int read(int fd, void *buf, int len){
+    if(fd == FD_STDIN){
+        flush();
+    }
+    return syscall(SYS_READ, fd, (int) buf, len, 0);
+}
+
+int write(int fd, const void *buf, int len){
+    return syscall(SYS_WRITE, fd, (int) buf, len, 0);
+}
+
+int lseek(int fd, int offset, int whence){
+    return syscall(SYS_LSEEK, fd, offset, whence, 0);
+}
+
+void *mmap(int fd, int offset, int len, int prot){
+    return (void *) syscall(SYS_MMAP, fd, offset, len, prot);
+}
+
+int munmap(void *addr, int len){
+    return syscall(SYS_MUNMAP, (int) addr, len, 0, 0);
 }
 
 /*
@@ -47,14 +122,28 @@ int getchar(void){
     커널의부팅 프로세스와 비슷하게 스택 포인터를 설정하고 main함수를 호출함
 
     커널과 달리 bss섹션을 0으로 초기화 하지 않는 이유는 이미 커널에서 초기화를 진행했기 때문에디ㅏ.(alloc_pages)
+    커널(user_entry)이 a0, a1에 넣어준 argc, argv를 그대로 main에 전달하므로 스택 포인터 설정에 a0, a1을 쓰면 안된다.
 */
 __attribute__((section(".text.start")))
 __attribute__((naked))
 void start(void) {
     __asm__ __volatile__(
-        "mv sp, %[stack_top] \n"
+        "la sp, __stack_top \n"
         "call main \n"
         "call exit \n"
-        :: [stack_top] "r" (__stack_top)
     );
-}
\ No newline at end of file
+}
+
+int fork(void){
+    flush(); // 자식이 출력되지 않은 내용을 한 번 더 출력하지 않도록 한다.
+    return syscall(SYS_FORK, 0, 0, 0, 0);
+}
+
+int spawn(const char *path, char **argv){
+    return syscall(SYS_SPAWN, (int) path, (int) argv, 0, 0);
+}
+
+int wait(int pid){
+    flush();
+    return syscall(SYS_WAIT, pid, 0, 0, 0);
+}